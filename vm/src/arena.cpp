@@ -0,0 +1,179 @@
+#include <new>
+#include <cstdint>
+#include <sys/mman.h>
+#include "arena.hpp"
+
+#ifdef __SANITIZE_ADDRESS__
+#include <sanitizer/asan_interface.h>
+#define POISON_SLOT(slot, size) ASAN_POISON_MEMORY_REGION(slot, size)
+#define UNPOISON_SLOT(slot, size) ASAN_UNPOISON_MEMORY_REGION(slot, size)
+#else
+#define POISON_SLOT(slot, size) ((void)(slot), (void)(size))
+#define UNPOISON_SLOT(slot, size) ((void)(slot), (void)(size))
+#endif
+
+using std::size_t;
+using std::uint32_t;
+using std::uintptr_t;
+
+#define PAGE_HEADER_SIZE ((sizeof(Page) + ARENA_SIZE_CLASS_STEP - 1) & ~(ARENA_SIZE_CLASS_STEP - 1))
+#define REGION_SIZE (ARENA_PAGE_SIZE * ARENA_PAGES_PER_REGION)
+
+Arena *Arena::current = nullptr;
+
+inline uint32_t sizeClassOf(size_t size)
+{
+    return (size + ARENA_SIZE_CLASS_STEP - 1) / ARENA_SIZE_CLASS_STEP - 1;
+}
+
+inline size_t slotSize(uint32_t sizeClass)
+{
+    return (sizeClass + 1) * ARENA_SIZE_CLASS_STEP;
+}
+
+Arena::Arena()
+{
+}
+
+Arena::~Arena()
+{
+    for (auto region : regions)
+    {
+        munmap(region, REGION_SIZE);
+    }
+}
+
+void *Arena::allocate(size_t size)
+{
+    if (size > ARENA_MAX_SMALL_SIZE)
+        return ::operator new(size);
+
+    auto sizeClass = sizeClassOf(size);
+    auto page = available[sizeClass];
+    if (!page)
+        page = newPage(sizeClass);
+
+    void *slot;
+    if (page->freeList)
+    {
+        slot = page->freeList;
+        UNPOISON_SLOT(slot, slotSize(sizeClass));
+        page->freeList = page->freeList->next;
+    }
+    else
+    {
+        slot = page->bump;
+        page->bump += slotSize(sizeClass);
+    }
+    page->live++;
+
+    auto end = reinterpret_cast<char *>(page) + ARENA_PAGE_SIZE;
+    if (!page->freeList && page->bump + slotSize(sizeClass) > end)
+        unlink(page);
+    return slot;
+}
+
+void Arena::free(void *pointer, size_t size)
+{
+    if (size > ARENA_MAX_SMALL_SIZE)
+    {
+        ::operator delete(pointer);
+        return;
+    }
+
+    auto page = reinterpret_cast<Page *>(reinterpret_cast<uintptr_t>(pointer) & ~uintptr_t{ARENA_PAGE_SIZE - 1});
+    auto slot = static_cast<FreeSlot *>(pointer);
+    slot->next = page->freeList;
+    page->freeList = slot;
+    POISON_SLOT(slot, slotSize(page->sizeClass));
+    page->live--;
+    if (!page->listed)
+        link(page);
+}
+
+// Called once a major collection is completely swept, returning pages to the
+// OS after every minor collection would fault them right back in.
+void Arena::releaseEmptyPages()
+{
+    for (auto page : available)
+    {
+        while (page)
+        {
+            auto next = page->next;
+            if (!page->live)
+            {
+                unlink(page);
+                UNPOISON_SLOT(page, ARENA_PAGE_SIZE);
+                madvise(page, ARENA_PAGE_SIZE, MADV_DONTNEED);
+                emptyPages.push_back(page);
+            }
+            page = next;
+        }
+    }
+}
+
+Arena::Page *Arena::newPage(uint32_t sizeClass)
+{
+    if (emptyPages.empty())
+        mapRegion();
+
+    auto page = emptyPages.back();
+    emptyPages.pop_back();
+    page->prev = nullptr;
+    page->next = nullptr;
+    page->freeList = nullptr;
+    page->bump = reinterpret_cast<char *>(page) + PAGE_HEADER_SIZE;
+    page->sizeClass = sizeClass;
+    page->live = 0;
+    page->listed = false;
+    link(page);
+    return page;
+}
+
+// Maps a region of pages aligned to the page size, so the page of an object
+// is found by masking its address.
+void Arena::mapRegion()
+{
+    auto length = REGION_SIZE + ARENA_PAGE_SIZE;
+    auto mapped = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapped == MAP_FAILED)
+        throw std::bad_alloc();
+
+    auto start = reinterpret_cast<uintptr_t>(mapped);
+    auto aligned = (start + ARENA_PAGE_SIZE - 1) & ~uintptr_t{ARENA_PAGE_SIZE - 1};
+    if (aligned > start)
+        munmap(mapped, aligned - start);
+    if (aligned + REGION_SIZE < start + length)
+        munmap(reinterpret_cast<void *>(aligned + REGION_SIZE), start + length - aligned - REGION_SIZE);
+
+    auto region = reinterpret_cast<char *>(aligned);
+    regions.push_back(region);
+    for (int i = ARENA_PAGES_PER_REGION - 1; i >= 0; i--)
+    {
+        emptyPages.push_back(reinterpret_cast<Page *>(region + i * ARENA_PAGE_SIZE));
+    }
+}
+
+void Arena::link(Page *page)
+{
+    auto &head = available[page->sizeClass];
+    page->prev = nullptr;
+    page->next = head;
+    if (head)
+        head->prev = page;
+    head = page;
+    page->listed = true;
+}
+
+void Arena::unlink(Page *page)
+{
+    if (page->prev)
+        page->prev->next = page->next;
+    else
+        available[page->sizeClass] = page->next;
+    if (page->next)
+        page->next->prev = page->prev;
+    page->prev = nullptr;
+    page->next = nullptr;
+    page->listed = false;
+}
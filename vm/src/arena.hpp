@@ -0,0 +1,59 @@
+#ifndef _ARENA_HPP_
+#define _ARENA_HPP_
+#include <array>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+#define ARENA_PAGE_SIZE (64 * 1024)
+#define ARENA_PAGES_PER_REGION 16
+#define ARENA_SIZE_CLASS_STEP 16
+#define ARENA_MAX_SMALL_SIZE 512
+#define ARENA_SIZE_CLASSES (ARENA_MAX_SMALL_SIZE / ARENA_SIZE_CLASS_STEP)
+
+// Heap of the Vm's objects. Small objects are carved out of pages that each
+// serve one size class, freed slots go to the free list of their page so a
+// sweep rebuilds the free lists as it goes. Pages a sweep left empty are
+// given back to the OS and later reused for any size class. Larger objects
+// go to the global allocator.
+class Arena
+{
+public:
+    explicit Arena();
+    ~Arena();
+    Arena(const Arena &) = delete;
+    Arena &operator=(const Arena &) = delete;
+    void *allocate(std::size_t);
+    void free(void *, std::size_t);
+    void releaseEmptyPages();
+
+    // Arena of the running Vm, Object::operator new allocates from it.
+    static Arena *current;
+
+private:
+    struct FreeSlot
+    {
+        FreeSlot *next;
+    };
+
+    struct Page
+    {
+        Page *prev;
+        Page *next;
+        FreeSlot *freeList;
+        char *bump;
+        std::uint32_t sizeClass;
+        std::uint32_t live;
+        bool listed;
+    };
+
+    Page *newPage(std::uint32_t);
+    void mapRegion();
+    void link(Page *);
+    void unlink(Page *);
+    // Pages of each size class that still have a free slot.
+    std::array<Page *, ARENA_SIZE_CLASSES> available{};
+    std::vector<Page *> emptyPages;
+    std::vector<void *> regions;
+};
+#endif
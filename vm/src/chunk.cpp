@@ -1,8 +1,10 @@
 #include "chunk.hpp"
 #include "value.hpp"
+#include "object.hpp"
 
 using std::move;
 using std::size_t;
+using std::uint16_t;
 using std::uint32_t;
 using std::uint8_t;
 
@@ -50,11 +52,23 @@ std::size_t Chunk::size() const
     return code.size();
 }
 
+// Bytes the chunk owns on the heap.
+std::size_t Chunk::heapSize() const
+{
+    return code.capacity() * sizeof(std::uint8_t) + constants.capacity() * sizeof(Value) +
+           lines.capacity() * sizeof(int) + caches.capacity() * sizeof(InlineCache);
+}
+
 Value Chunk::getConstant(int index) const
 {
     return constants[index];
 }
 
+const Value *Chunk::getConstantBaseAddr() const
+{
+    return constants.data();
+}
+
 int Chunk::getLine(int index) const
 {
     return lines[index];
@@ -63,4 +77,173 @@ int Chunk::getLine(int index) const
 uint8_t *Chunk::getCodeBaseAddr()
 {
     return code.data();
-}
\ No newline at end of file
+}
+
+int Chunk::instructionLength(int offset) const
+{
+    switch (static_cast<Opcode>(code[offset]))
+    {
+    case Opcode::OP_CONSTANT:
+    case Opcode::OP_GET_LOCAL:
+    case Opcode::OP_SET_LOCAL:
+    case Opcode::OP_GET_UPVALUE:
+    case Opcode::OP_SET_UPVALUE:
+    case Opcode::OP_GET_SUPER:
+    case Opcode::OP_CALL:
+    case Opcode::OP_TAIL_CALL:
+    case Opcode::OP_CLASS:
+    case Opcode::OP_METHOD:
+        return 2;
+    case Opcode::OP_GET_GLOBAL:
+    case Opcode::OP_SET_GLOBAL:
+    case Opcode::OP_DEFINE_GLOBAL:
+    case Opcode::OP_JUMP:
+    case Opcode::OP_JUMP_IF_FALSE:
+    case Opcode::OP_POP_JUMP_IF_FALSE:
+    case Opcode::OP_LOOP:
+    case Opcode::OP_INVOKE_SUPER:
+    case Opcode::OP_ADD_LOCALS:
+    case Opcode::OP_SUBTRACT_LOCALS:
+    case Opcode::OP_MULTIPLY_LOCALS:
+    case Opcode::OP_DIVIDE_LOCALS:
+        return 3;
+    case Opcode::OP_GET_PROPERTY:
+    case Opcode::OP_SET_PROPERTY:
+        return 4;
+    case Opcode::OP_INVOKE:
+    case Opcode::OP_CONSTANT_32:
+    case Opcode::OP_LESS_LOCAL_CONST_JUMP:
+    case Opcode::OP_GREATER_LOCAL_CONST_JUMP:
+        return 5;
+    case Opcode::OP_CLOSURE:
+    {
+        auto function = asFunction(constants[code[offset + 1]]);
+        return 2 + 2 * function->upvalueCount;
+    }
+    default:
+        return 1;
+    }
+}
+
+int Chunk::jumpTarget(int offset) const
+{
+    auto sign = 0;
+    switch (static_cast<Opcode>(code[offset]))
+    {
+    case Opcode::OP_JUMP:
+    case Opcode::OP_JUMP_IF_FALSE:
+    case Opcode::OP_POP_JUMP_IF_FALSE:
+    case Opcode::OP_LESS_LOCAL_CONST_JUMP:
+    case Opcode::OP_GREATER_LOCAL_CONST_JUMP:
+        sign = 1;
+        break;
+    case Opcode::OP_LOOP:
+        sign = -1;
+        break;
+    default:
+        return -1;
+    }
+
+    // The jump distance is always the last operand and counts from the end
+    // of the instruction.
+    auto end = offset + instructionLength(offset);
+    auto jump = static_cast<uint16_t>((code[end - 2] << 8) | code[end - 1]);
+    return end + sign * jump;
+}
+
+// Values the instruction leaves on the stack minus the ones it takes off.
+int Chunk::stackEffect(int offset) const
+{
+    switch (static_cast<Opcode>(code[offset]))
+    {
+    case Opcode::OP_CONSTANT:
+    case Opcode::OP_CONSTANT_32:
+    case Opcode::OP_NIL:
+    case Opcode::OP_TRUE:
+    case Opcode::OP_FALSE:
+    case Opcode::OP_GET_LOCAL:
+    case Opcode::OP_GET_GLOBAL:
+    case Opcode::OP_GET_UPVALUE:
+    case Opcode::OP_CLOSURE:
+    case Opcode::OP_CLASS:
+    case Opcode::OP_ADD_LOCALS:
+    case Opcode::OP_SUBTRACT_LOCALS:
+    case Opcode::OP_MULTIPLY_LOCALS:
+    case Opcode::OP_DIVIDE_LOCALS:
+        return 1;
+    case Opcode::OP_POP:
+    case Opcode::OP_DEFINE_GLOBAL:
+    case Opcode::OP_SET_PROPERTY:
+    case Opcode::OP_GET_SUPER:
+    case Opcode::OP_EQUAL:
+    case Opcode::OP_GREATER:
+    case Opcode::OP_LESS:
+    case Opcode::OP_ADD:
+    case Opcode::OP_SUBTRACT:
+    case Opcode::OP_MULTIPLY:
+    case Opcode::OP_DIVIDE:
+    case Opcode::OP_ADD_NUM:
+    case Opcode::OP_ADD_STR:
+    case Opcode::OP_SUBTRACT_NUM:
+    case Opcode::OP_MULTIPLY_NUM:
+    case Opcode::OP_DIVIDE_NUM:
+    case Opcode::OP_EQUAL_NUM:
+    case Opcode::OP_GREATER_NUM:
+    case Opcode::OP_LESS_NUM:
+    case Opcode::OP_PRINT:
+    case Opcode::OP_CLOSE_UPVALUE:
+    case Opcode::OP_RETURN:
+    case Opcode::OP_INHERIT:
+    case Opcode::OP_METHOD:
+    case Opcode::OP_POP_JUMP_IF_FALSE:
+        return -1;
+    case Opcode::OP_CALL:
+    case Opcode::OP_TAIL_CALL:
+        return -code[offset + 1];
+    case Opcode::OP_INVOKE:
+        return -code[offset + 2];
+    case Opcode::OP_INVOKE_SUPER:
+        return -code[offset + 2] - 1;
+    default:
+        return 0;
+    }
+}
+
+void Chunk::replaceCode(std::vector<uint8_t> code, std::vector<int> lines)
+{
+    this->code = move(code);
+    this->lines = move(lines);
+}
+
+int Chunk::addInlineCache()
+{
+    caches.emplace_back();
+    return caches.size() - 1;
+}
+
+InlineCache *Chunk::getInlineCacheBaseAddr()
+{
+    return caches.data();
+}
+
+void InlineCache::update(InlineCacheEntry newEntry)
+{
+    if (megamorphic)
+        return;
+
+    auto entry = find(newEntry.shape);
+    if (!entry)
+    {
+        if (count == INLINE_CACHE_WAYS)
+        {
+            // Too many receiver shapes at this site, stop caching for good.
+            megamorphic = true;
+            entries = {};
+            count = 0;
+            return;
+        }
+        entry = &entries[count++];
+    }
+
+    *entry = move(newEntry);
+}
@@ -2,49 +2,115 @@
 #define _CHUNK_HPP_
 #include <vector>
 #include <span>
+#include <array>
+#include <memory>
 #include "value.hpp"
 #include "gc.hpp"
 
+// The _NUM and _STR forms are never emitted by the compiler, Vm::run rewrites
+// generic arithmetic and comparison instructions into them in place once it
+// has seen the operand types, and back when the guess stops holding.
+// The _LOCALS, _LOCAL_CONST_JUMP and OP_POP_JUMP_IF_FALSE superinstructions are
+// only produced by the peephole pass in Compiler::endCompiler.
+#define OPCODES(X)                 \
+    X(OP_CONSTANT)                 \
+    X(OP_CONSTANT_32)              \
+    X(OP_NIL)                      \
+    X(OP_TRUE)                     \
+    X(OP_FALSE)                    \
+    X(OP_POP)                      \
+    X(OP_GET_LOCAL)                \
+    X(OP_SET_LOCAL)                \
+    X(OP_GET_GLOBAL)               \
+    X(OP_SET_GLOBAL)               \
+    X(OP_DEFINE_GLOBAL)            \
+    X(OP_GET_UPVALUE)              \
+    X(OP_SET_UPVALUE)              \
+    X(OP_GET_PROPERTY)             \
+    X(OP_SET_PROPERTY)             \
+    X(OP_GET_SUPER)                \
+    X(OP_EQUAL)                    \
+    X(OP_GREATER)                  \
+    X(OP_LESS)                     \
+    X(OP_ADD)                      \
+    X(OP_SUBTRACT)                 \
+    X(OP_MULTIPLY)                 \
+    X(OP_DIVIDE)                   \
+    X(OP_NOT)                      \
+    X(OP_NEGATE)                   \
+    X(OP_PRINT)                    \
+    X(OP_JUMP)                     \
+    X(OP_JUMP_IF_FALSE)            \
+    X(OP_LOOP)                     \
+    X(OP_CALL)                     \
+    X(OP_TAIL_CALL)                \
+    X(OP_INVOKE)                   \
+    X(OP_INVOKE_SUPER)             \
+    X(OP_CLOSURE)                  \
+    X(OP_CLOSE_UPVALUE)            \
+    X(OP_RETURN)                   \
+    X(OP_CLASS)                    \
+    X(OP_INHERIT)                  \
+    X(OP_METHOD)                   \
+    X(OP_ADD_NUM)                  \
+    X(OP_ADD_STR)                  \
+    X(OP_SUBTRACT_NUM)             \
+    X(OP_MULTIPLY_NUM)             \
+    X(OP_DIVIDE_NUM)               \
+    X(OP_EQUAL_NUM)                \
+    X(OP_GREATER_NUM)              \
+    X(OP_LESS_NUM)                 \
+    X(OP_ADD_LOCALS)               \
+    X(OP_SUBTRACT_LOCALS)          \
+    X(OP_MULTIPLY_LOCALS)          \
+    X(OP_DIVIDE_LOCALS)            \
+    X(OP_LESS_LOCAL_CONST_JUMP)    \
+    X(OP_GREATER_LOCAL_CONST_JUMP) \
+    X(OP_POP_JUMP_IF_FALSE)
+
+#define INLINE_CACHE_WAYS 4
+
+struct ClassObject;
+struct ClosureObject;
+struct Shape;
+
+// OP_GET_PROPERTY, OP_SET_PROPERTY and OP_INVOKE carry the index of an inline
+// cache as their last two operand bytes. Each entry is keyed on the receiver's
+// shape and holds the field slot, the method closure, or for stores that add
+// a field, the shape the instance moves to. The Gc marks klass, which keeps
+// the shape alive.
+struct InlineCacheEntry
+{
+    ClassObject *klass = nullptr;
+    const Shape *shape = nullptr;
+    int slot = -1;
+    ClosureObject *method = nullptr;
+    Shape *transition = nullptr;
+};
+
+struct InlineCache
+{
+    InlineCacheEntry *find(const Shape *shape)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            if (entries[i].shape == shape)
+                return &entries[i];
+        }
+        return nullptr;
+    }
+    void update(InlineCacheEntry);
+
+    std::array<InlineCacheEntry, INLINE_CACHE_WAYS> entries{};
+    int count = 0;
+    bool megamorphic = false;
+};
+
 enum class Opcode : std::uint8_t
 {
-    OP_CONSTANT,
-    OP_CONSTANT_32,
-    OP_NIL,
-    OP_TRUE,
-    OP_FALSE,
-    OP_POP,
-    OP_GET_LOCAL,
-    OP_SET_LOCAL,
-    OP_GET_GLOBAL,
-    OP_SET_GLOBAL,
-    OP_DEFINE_GLOBAL,
-    OP_GET_UPVALUE,
-    OP_SET_UPVALUE,
-    OP_GET_PROPERTY,
-    OP_SET_PROPERTY,
-    OP_GET_SUPER,
-    OP_EQUAL,
-    OP_GREATER,
-    OP_LESS,
-    OP_ADD,
-    OP_SUBTRACT,
-    OP_MULTIPLY,
-    OP_DIVIDE,
-    OP_NOT,
-    OP_NEGATE,
-    OP_PRINT,
-    OP_JUMP,
-    OP_JUMP_IF_FALSE,
-    OP_LOOP,
-    OP_CALL,
-    OP_INVOKE,
-    OP_INVOKE_SUPER,
-    OP_CLOSURE,
-    OP_CLOSE_UPVALUE,
-    OP_RETURN,
-    OP_CLASS,
-    OP_INHERIT,
-    OP_METHOD,
+#define OPCODE_ENUM(op) op,
+    OPCODES(OPCODE_ENUM)
+#undef OPCODE_ENUM
 };
 
 class Chunk
@@ -59,14 +125,23 @@ public:
     const std::uint8_t operator[](std::size_t) const;
     std::uint8_t &operator[](std::size_t);
     std::size_t size() const;
+    std::size_t heapSize() const;
     Value getConstant(int index) const;
+    const Value *getConstantBaseAddr() const;
     int getLine(int index) const;
     std::uint8_t *getCodeBaseAddr();
+    int instructionLength(int offset) const;
+    int jumpTarget(int offset) const;
+    int stackEffect(int offset) const;
+    void replaceCode(std::vector<std::uint8_t>, std::vector<int>);
+    int addInlineCache();
+    InlineCache *getInlineCacheBaseAddr();
 
 private:
     friend Gc;
     std::vector<std::uint8_t> code;
     std::vector<Value> constants;
     std::vector<int> lines;
+    std::vector<InlineCache> caches;
 };
 #endif
\ No newline at end of file
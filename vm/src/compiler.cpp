@@ -18,7 +18,6 @@ using std::make_optional;
 using std::make_tuple;
 using std::move;
 using std::nullopt;
-using std::shared_ptr;
 using std::uint8_t;
 
 enum class Precedence : std::uint32_t
@@ -64,12 +63,25 @@ Compiler::Compiler(StringInternProps stringInternProps) : Compiler(FunctionType:
     this->stringInternProps = move(stringInternProps);
 }
 
+Compiler::Compiler(StringInternProps stringInternProps, AddObjectFunc addObject) : Compiler(move(stringInternProps))
+{
+    this->addObject = move(addObject);
+}
+
+Compiler::Compiler(StringInternProps stringInternProps, AddObjectFunc addObject, ResolveGlobalFunc resolveGlobal)
+    : Compiler(move(stringInternProps), move(addObject))
+{
+    this->resolveGlobal = move(resolveGlobal);
+}
+
 Compiler::Compiler(const Compiler &&other)
 {
     this->initRules();
     parser = move(other.parser);
     scanner = move(other.scanner);
     stringInternProps = move(other.stringInternProps);
+    addObject = move(other.addObject);
+    resolveGlobal = move(other.resolveGlobal);
     currentClass = other.currentClass;
     this->initInternals(other.internals.type);
 }
@@ -80,6 +92,8 @@ Compiler::Compiler(Compiler *other, FunctionType type) : enclosing{other}
     parser = other->parser;
     scanner = other->scanner;
     stringInternProps = other->stringInternProps;
+    addObject = other->addObject;
+    resolveGlobal = other->resolveGlobal;
     currentClass = other->currentClass;
     initInternals(type);
 }
@@ -102,7 +116,10 @@ CompileReturn Compiler::compile(std::string &source)
     }
 
     if (this->parser->hadError)
+    {
+        trackObject(internals.function);
         return make_tuple(CompileResult::COMPILE_ERROR, nullopt);
+    }
 
     auto function = endCompiler();
 
@@ -179,9 +196,10 @@ void Compiler::classDeclaration()
     auto className = parser->previous;
     auto nameConstant = identifierConstant(parser->previous);
     declareVariable();
+    auto global = internals.scopeDepth > 0 ? 0 : globalSlot(className);
 
     emitBytes(Opcode::OP_CLASS, nameConstant);
-    defineVariable(nameConstant);
+    defineVariable(global);
 
     auto classCompiler = ClassCompiler{currentClass};
     currentClass = &classCompiler;
@@ -295,8 +313,18 @@ void Compiler::returnStatement()
         if (internals.type == FunctionType::TYPE_INITIALIZER)
             error("Can't return a value from an initializer.");
 
+        int start = currentChunk()->size();
         expression();
         consume(TokenType::SEMICOLON, "Expect ';' after return value.");
+
+        // A call whose result is returned as is runs in the caller's frame.
+        auto chunk = currentChunk();
+        int size = chunk->size();
+        auto last = -1;
+        for (auto offset = start; offset < size; offset += chunk->instructionLength(offset))
+            last = offset;
+        if (last >= 0 && static_cast<Opcode>((*chunk)[last]) == Opcode::OP_CALL)
+            (*chunk)[last] = static_cast<uint8_t>(Opcode::OP_TAIL_CALL);
         emitByte(Opcode::OP_RETURN);
     }
 }
@@ -512,15 +540,20 @@ void Compiler::dot(bool canAssign)
     {
         expression();
         emitBytes(Opcode::OP_SET_PROPERTY, name);
+        emitInlineCache();
     }
     else if (match(TokenType::LEFT_PAREN))
     {
         auto argCount = argumentList();
         emitBytes(Opcode::OP_INVOKE, name);
         emitByte(argCount);
+        emitInlineCache();
     }
     else
+    {
         emitBytes(Opcode::OP_GET_PROPERTY, name);
+        emitInlineCache();
+    }
 }
 
 void Compiler::literal(bool canAssign)
@@ -606,16 +639,16 @@ void Compiler::namedVariable(const Token &name, bool canAssign)
     {
         getOp = Opcode::OP_GET_GLOBAL;
         setOp = Opcode::OP_SET_GLOBAL;
-        arg = identifierConstant(name);
+        arg = globalSlot(name);
     }
 
     if (canAssign && match(TokenType::EQUAL))
     {
         expression();
-        emitBytes(setOp, arg);
+        emitVariable(setOp, arg);
     }
     else
-        emitBytes(getOp, arg);
+        emitVariable(getOp, arg);
 }
 
 void Compiler::advance()
@@ -689,10 +722,15 @@ bool Compiler::match(TokenType expected)
     return true;
 }
 
-shared_ptr<FunctionObject> Compiler::endCompiler()
+FunctionObject *Compiler::endCompiler()
 {
     emitReturn();
     auto function = internals.function;
+    if (!parser->hadError)
+    {
+        peephole();
+        function->stackSize = computeStackSize();
+    }
 
 #ifdef DEBUG_PRINT_CODE
     if (!parser->hadError)
@@ -703,9 +741,209 @@ shared_ptr<FunctionObject> Compiler::endCompiler()
 #endif
 
     emitBytes(Opcode::OP_CLOSURE, makeConstant(objectValue(function)));
+    // Tracked once complete so the Gc accounts for the finished chunk.
+    trackObject(function);
     return function;
 }
 
+// Follows every path through the finished chunk to find the highest stack
+// the function reaches, Vm::call reserves that much before running it.
+int Compiler::computeStackSize()
+{
+    auto chunk = currentChunk();
+    int size = chunk->size();
+    std::vector<int> heights(size + 1, -1);
+    std::vector<int> pending{0};
+    // Slot zero holds the callee, the arguments follow.
+    heights[0] = internals.function->arity + 1;
+    auto highest = heights[0];
+    auto reach = [&](int offset, int height)
+    {
+        if (heights[offset] < 0)
+        {
+            heights[offset] = height;
+            pending.push_back(offset);
+        }
+    };
+
+    while (!pending.empty())
+    {
+        auto offset = pending.back();
+        pending.pop_back();
+        auto opcode = static_cast<Opcode>((*chunk)[offset]);
+        auto height = heights[offset] + chunk->stackEffect(offset);
+        highest = std::max(highest, height);
+
+        auto target = chunk->jumpTarget(offset);
+        if (target >= 0)
+            reach(target, height);
+        if (opcode != Opcode::OP_RETURN && opcode != Opcode::OP_JUMP && opcode != Opcode::OP_LOOP)
+            reach(offset + chunk->instructionLength(offset), height);
+    }
+    return highest;
+}
+
+// Rewrites common instruction sequences of the finished chunk into
+// superinstructions. A sequence is only fused when no jump lands inside it,
+// jumps are re-targeted to the new offsets afterwards.
+void Compiler::peephole()
+{
+    auto chunk = currentChunk();
+    int size = chunk->size();
+
+    std::vector<int> starts;
+    std::vector<bool> isTarget(size + 1, false);
+    for (int offset = 0; offset < size; offset += chunk->instructionLength(offset))
+    {
+        starts.push_back(offset);
+        auto target = chunk->jumpTarget(offset);
+        if (target < 0)
+            continue;
+
+        isTarget[target] = true;
+        // A folded OP_POP_JUMP_IF_FALSE lands after the OP_POP at its target.
+        if (target < size && static_cast<Opcode>((*chunk)[target]) == Opcode::OP_POP)
+            isTarget[target + 1] = true;
+    }
+
+    struct PendingJump
+    {
+        int operand;
+        int target;
+        int sign;
+    };
+    std::vector<uint8_t> code;
+    std::vector<int> lines;
+    std::vector<int> newOffsets(size + 1, -1);
+    std::vector<PendingJump> jumps;
+
+    auto opcodeAt = [&](size_t index)
+    { return static_cast<Opcode>((*chunk)[starts[index]]); };
+    auto operandAt = [&](size_t index, int operand)
+    { return (*chunk)[starts[index] + operand]; };
+    auto canFuse = [&](size_t index, size_t count)
+    {
+        if (index + count > starts.size())
+            return false;
+        for (size_t i = index + 1; i < index + count; i++)
+        {
+            if (isTarget[starts[i]])
+                return false;
+        }
+        return true;
+    };
+    auto popsAtTarget = [&](size_t index)
+    {
+        auto target = chunk->jumpTarget(starts[index]);
+        return target < size && static_cast<Opcode>((*chunk)[target]) == Opcode::OP_POP;
+    };
+    auto emit = [&](uint8_t byte, int line)
+    {
+        code.push_back(byte);
+        lines.push_back(line);
+    };
+    auto emitJumpTo = [&](int target, int sign, int line)
+    {
+        jumps.push_back(PendingJump{static_cast<int>(code.size()), target, sign});
+        emit(0xff, line);
+        emit(0xff, line);
+    };
+
+    for (size_t i = 0; i < starts.size();)
+    {
+        auto offset = starts[i];
+        newOffsets[offset] = code.size();
+        auto opcode = opcodeAt(i);
+
+        // OP_GET_LOCAL a; OP_CONSTANT k; OP_LESS; OP_JUMP_IF_FALSE; OP_POP
+        if (opcode == Opcode::OP_GET_LOCAL && canFuse(i, 5) &&
+            opcodeAt(i + 1) == Opcode::OP_CONSTANT &&
+            (opcodeAt(i + 2) == Opcode::OP_LESS || opcodeAt(i + 2) == Opcode::OP_GREATER) &&
+            opcodeAt(i + 3) == Opcode::OP_JUMP_IF_FALSE && popsAtTarget(i + 3) &&
+            opcodeAt(i + 4) == Opcode::OP_POP)
+        {
+            auto line = chunk->getLine(starts[i + 2]);
+            auto fused = opcodeAt(i + 2) == Opcode::OP_LESS
+                             ? Opcode::OP_LESS_LOCAL_CONST_JUMP
+                             : Opcode::OP_GREATER_LOCAL_CONST_JUMP;
+            emit(static_cast<uint8_t>(fused), line);
+            emit(operandAt(i, 1), line);
+            emit(operandAt(i + 1, 1), line);
+            emitJumpTo(chunk->jumpTarget(starts[i + 3]) + 1, 1, line);
+            i += 5;
+            continue;
+        }
+
+        // OP_GET_LOCAL a; OP_GET_LOCAL b; arithmetic
+        if (opcode == Opcode::OP_GET_LOCAL && canFuse(i, 3) &&
+            opcodeAt(i + 1) == Opcode::OP_GET_LOCAL)
+        {
+            std::optional<Opcode> fused;
+            switch (opcodeAt(i + 2))
+            {
+            case Opcode::OP_ADD:
+                fused = Opcode::OP_ADD_LOCALS;
+                break;
+            case Opcode::OP_SUBTRACT:
+                fused = Opcode::OP_SUBTRACT_LOCALS;
+                break;
+            case Opcode::OP_MULTIPLY:
+                fused = Opcode::OP_MULTIPLY_LOCALS;
+                break;
+            case Opcode::OP_DIVIDE:
+                fused = Opcode::OP_DIVIDE_LOCALS;
+                break;
+            default:
+                break;
+            }
+
+            if (fused)
+            {
+                auto line = chunk->getLine(starts[i + 2]);
+                emit(static_cast<uint8_t>(fused.value()), line);
+                emit(operandAt(i, 1), line);
+                emit(operandAt(i + 1, 1), line);
+                i += 3;
+                continue;
+            }
+        }
+
+        // OP_JUMP_IF_FALSE; OP_POP, when the jump target pops the condition too
+        if (opcode == Opcode::OP_JUMP_IF_FALSE && canFuse(i, 2) && popsAtTarget(i) &&
+            opcodeAt(i + 1) == Opcode::OP_POP)
+        {
+            auto line = chunk->getLine(offset);
+            emit(static_cast<uint8_t>(Opcode::OP_POP_JUMP_IF_FALSE), line);
+            emitJumpTo(chunk->jumpTarget(offset) + 1, 1, line);
+            i += 2;
+            continue;
+        }
+
+        auto length = chunk->instructionLength(offset);
+        auto target = chunk->jumpTarget(offset);
+        auto copied = target < 0 ? length : length - 2;
+        for (int j = 0; j < copied; j++)
+            emit((*chunk)[offset + j], chunk->getLine(offset + j));
+        if (target >= 0)
+            emitJumpTo(target, opcode == Opcode::OP_LOOP ? -1 : 1, chunk->getLine(offset));
+        i++;
+    }
+    newOffsets[size] = code.size();
+
+    for (auto &jump : jumps)
+    {
+        auto target = newOffsets[jump.target];
+        assert(target >= 0);
+        // Distances are relative to the end of the instruction, which is
+        // where the jump operand ends.
+        auto distance = jump.sign * (target - (jump.operand + 2));
+        code[jump.operand] = (distance >> 8) & 0xff;
+        code[jump.operand + 1] = distance & 0xff;
+    }
+
+    chunk->replaceCode(move(code), move(lines));
+}
+
 void Compiler::beginScope()
 {
     internals.scopeDepth++;
@@ -714,7 +952,7 @@ void Compiler::beginScope()
 void Compiler::endScope()
 {
     internals.scopeDepth--;
-    while (internals.scopeDepth > 0 &&
+    while (internals.localCount > 0 &&
            internals.locals[internals.localCount - 1].depth > internals.scopeDepth)
     {
         if (internals.locals[internals.localCount - 1].isCaptured)
@@ -788,6 +1026,30 @@ void Compiler::emitConstant(Value value)
     emitBytes(Opcode::OP_CONSTANT, index);
 }
 
+void Compiler::emitVariable(Opcode opcode, int arg)
+{
+    if (opcode != Opcode::OP_GET_GLOBAL && opcode != Opcode::OP_SET_GLOBAL && opcode != Opcode::OP_DEFINE_GLOBAL)
+    {
+        emitBytes(opcode, arg);
+        return;
+    }
+
+    // Global slots take two bytes.
+    emitByte(opcode);
+    emitByte((arg >> 8) & 0xff);
+    emitByte(arg & 0xff);
+}
+
+void Compiler::emitInlineCache()
+{
+    auto index = currentChunk()->addInlineCache();
+    if (index > UINT16_MAX)
+        error("Too many property accesses in one chunk.");
+
+    emitByte((index >> 8) & 0xff);
+    emitByte(index & 0xff);
+}
+
 void Compiler::patchJump(int offset)
 {
     auto chunk = currentChunk();
@@ -844,6 +1106,25 @@ uint8_t Compiler::identifierConstant(const Token &token)
     return makeConstant(objectValue(move(s)));
 }
 
+// Globals are addressed by their slot in the Vm, which hands out a slot per
+// name the first time the name is seen, defined or not.
+int Compiler::globalSlot(const Token &token)
+{
+    if (!resolveGlobal)
+    {
+        error("Can't resolve global variables without a Vm.");
+        return 0;
+    }
+
+    auto slot = resolveGlobal.value()(copyString(token.start, token.length));
+    if (slot > UINT16_MAX)
+    {
+        error("Too many global variables.");
+        return 0;
+    }
+    return slot;
+}
+
 bool Compiler::identifiersEqual(const Token &t1, const Token &t2) const
 {
     if (t1.length != t2.length)
@@ -940,13 +1221,13 @@ void Compiler::declareVariable()
     addLocal(name);
 }
 
-uint8_t Compiler::parseVariable(const char *errorMsg)
+int Compiler::parseVariable(const char *errorMsg)
 {
     consume(TokenType::IDENTIFIER, errorMsg);
     declareVariable();
     if (internals.scopeDepth > 0)
         return 0;
-    return identifierConstant(parser->previous);
+    return globalSlot(parser->previous);
 }
 
 void Compiler::markInitialized()
@@ -956,7 +1237,7 @@ void Compiler::markInitialized()
     internals.locals[internals.localCount - 1].depth = internals.scopeDepth;
 }
 
-void Compiler::defineVariable(uint8_t global)
+void Compiler::defineVariable(int global)
 {
     if (internals.scopeDepth > 0)
     {
@@ -964,7 +1245,7 @@ void Compiler::defineVariable(uint8_t global)
         return;
     }
 
-    emitBytes(Opcode::OP_DEFINE_GLOBAL, global);
+    emitVariable(Opcode::OP_DEFINE_GLOBAL, global);
 }
 
 uint8_t Compiler::argumentList()
@@ -1012,23 +1293,31 @@ Compiler::ParseRule &Compiler::getRule(TokenType &type)
     return rules[to_underlying(type)];
 }
 
-shared_ptr<StringObject> Compiler::copyString(const char *ptr, int len)
+StringObject *Compiler::copyString(const char *ptr, int len)
 {
-    std::string str(ptr, len);
+    std::string_view str(ptr, len);
 
     if (stringInternProps)
     {
-        auto props = stringInternProps.value();
-        auto found = props.tryFindInternedString(str);
+        auto &props = stringInternProps.value();
+        auto hash = hashString(str);
+        auto found = props.tryFindInternedString(str, hash);
         if (found)
             return found.value();
 
-        auto stringObject = newString(str);
+        auto stringObject = newHashedString(std::string{str}, hash);
+        trackObject(stringObject);
         props.addStringToIntern(stringObject);
         return stringObject;
     }
 
-    return newString(str);
+    return newString(std::string{str});
+}
+
+void Compiler::trackObject(Object *obj)
+{
+    if (addObject)
+        addObject.value()(move(obj));
 }
 
 Chunk *Compiler::currentChunk()
@@ -27,9 +27,11 @@ enum class FunctionType
     TYPE_METHOD,
     TYPE_SCRIPT,
 };
-using CompileReturn = std::tuple<CompileResult, std::optional<std::shared_ptr<FunctionObject>>>;
-using TryFindInternedStringFunc = std::function<std::optional<std::shared_ptr<StringObject>>(std::string &)>;
-using AddStringToInternFunc = std::function<void(std::shared_ptr<StringObject>)>;
+using CompileReturn = std::tuple<CompileResult, std::optional<FunctionObject *>>;
+using TryFindInternedStringFunc = std::function<std::optional<StringObject *>(std::string_view, std::uint32_t)>;
+using AddStringToInternFunc = std::function<void(StringObject *)>;
+using AddObjectFunc = std::function<void(Object *)>;
+using ResolveGlobalFunc = std::function<int(StringObject *)>;
 
 struct StringInternProps
 {
@@ -43,6 +45,8 @@ public:
     using ParseFn = std::function<void(bool)>;
     explicit Compiler();
     explicit Compiler(StringInternProps);
+    explicit Compiler(StringInternProps, AddObjectFunc);
+    explicit Compiler(StringInternProps, AddObjectFunc, ResolveGlobalFunc);
     Compiler(const Compiler &&other);
     Compiler(Compiler *other, FunctionType);
 
@@ -68,7 +72,7 @@ private:
     };
     struct Internals
     {
-        std::shared_ptr<FunctionObject> function;
+        FunctionObject *function;
         FunctionType type;
         std::array<Local, UINT8_COUNT> locals;
         int localCount;
@@ -123,7 +127,9 @@ private:
     void consume(TokenType, const char *message);
     bool check(TokenType);
     bool match(TokenType);
-    std::shared_ptr<FunctionObject> endCompiler();
+    FunctionObject *endCompiler();
+    void peephole();
+    int computeStackSize();
     void beginScope();
     void endScope();
     void emitByte(std::uint8_t);
@@ -135,11 +141,14 @@ private:
     int emitJump(Opcode);
     void emitReturn();
     void emitConstant(Value);
+    void emitVariable(Opcode, int);
+    void emitInlineCache();
     void patchJump(int);
     ParseRule &getRule(TokenType &);
     std::uint8_t makeConstant(Value);
     void parsePrecedence(Precedence);
     std::uint8_t identifierConstant(const Token &);
+    int globalSlot(const Token &);
     bool identifiersEqual(const Token &, const Token &) const;
     int resolveLocal(const Token &) const;
     int addUpvalue(std::uint8_t, bool);
@@ -147,13 +156,14 @@ private:
     void addLocal(const Token);
     void addConstant(const Token);
     void declareVariable();
-    std::uint8_t parseVariable(const char *);
+    int parseVariable(const char *);
     void markInitialized();
-    void defineVariable(std::uint8_t);
+    void defineVariable(int);
     std::uint8_t argumentList();
     void and_(bool);
     void or_(bool);
-    std::shared_ptr<StringObject> copyString(const char *, int);
+    StringObject *copyString(const char *, int);
+    void trackObject(Object *);
     Chunk *currentChunk();
     void initInternals(FunctionType type);
     void initRules();
@@ -163,6 +173,8 @@ private:
     Compiler *const enclosing = nullptr;
     std::array<ParseRule, static_cast<int>(TokenType::EOF_) + 1> rules;
     std::optional<StringInternProps> stringInternProps = std::nullopt;
+    std::optional<AddObjectFunc> addObject = std::nullopt;
+    std::optional<ResolveGlobalFunc> resolveGlobal = std::nullopt;
     ClassCompiler *currentClass = nullptr;
 };
 #endif
\ No newline at end of file
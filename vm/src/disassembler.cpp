@@ -46,19 +46,19 @@ int Disassembler::disassembleInstruction(int offset)
     case Opcode::OP_SET_LOCAL:
         return byteInstruction("OP_SET_LOCAL", offset);
     case Opcode::OP_GET_GLOBAL:
-        return constantInstruction("OP_GET_GLOBAL", offset);
+        return globalInstruction("OP_GET_GLOBAL", offset);
     case Opcode::OP_DEFINE_GLOBAL:
-        return constantInstruction("OP_DEFINE_GLOBAL", offset);
+        return globalInstruction("OP_DEFINE_GLOBAL", offset);
     case Opcode::OP_SET_GLOBAL:
-        return constantInstruction("OP_SET_GLOBAL", offset);
+        return globalInstruction("OP_SET_GLOBAL", offset);
     case Opcode::OP_GET_UPVALUE:
         return byteInstruction("OP_GET_UPVALUE", offset);
     case Opcode::OP_SET_UPVALUE:
         return byteInstruction("OP_SET_UPVALUE", offset);
     case Opcode::OP_GET_PROPERTY:
-        return constantInstruction("OP_GET_PROPERTY", offset);
+        return cachedInstruction("OP_GET_PROPERTY", offset);
     case Opcode::OP_SET_PROPERTY:
-        return constantInstruction("OP_SET_PROPERTY", offset);
+        return cachedInstruction("OP_SET_PROPERTY", offset);
     case Opcode::OP_GET_SUPER:
         return constantInstruction("OP_GET_SUPER", offset);
     case Opcode::OP_ADD:
@@ -89,8 +89,10 @@ int Disassembler::disassembleInstruction(int offset)
         return jumpInstruction("OP_LOOP", -1, offset);
     case Opcode::OP_CALL:
         return byteInstruction("OP_CALL", offset);
+    case Opcode::OP_TAIL_CALL:
+        return byteInstruction("OP_TAIL_CALL", offset);
     case Opcode::OP_INVOKE:
-        return invokeInstruction("OP_INVOKE", offset);
+        return cachedInvokeInstruction("OP_INVOKE", offset);
     case Opcode::OP_INVOKE_SUPER:
         return invokeInstruction("OP_INVOKE_SUPER", offset);
     case Opcode::OP_CLOSURE:
@@ -120,6 +122,36 @@ int Disassembler::disassembleInstruction(int offset)
         return constantInstruction("OP_METHOD", offset);
     case Opcode::OP_RETURN:
         return simpleInstruction("OP_RETURN", offset);
+    case Opcode::OP_ADD_NUM:
+        return simpleInstruction("OP_ADD_NUM", offset);
+    case Opcode::OP_ADD_STR:
+        return simpleInstruction("OP_ADD_STR", offset);
+    case Opcode::OP_SUBTRACT_NUM:
+        return simpleInstruction("OP_SUBTRACT_NUM", offset);
+    case Opcode::OP_MULTIPLY_NUM:
+        return simpleInstruction("OP_MULTIPLY_NUM", offset);
+    case Opcode::OP_DIVIDE_NUM:
+        return simpleInstruction("OP_DIVIDE_NUM", offset);
+    case Opcode::OP_EQUAL_NUM:
+        return simpleInstruction("OP_EQUAL_NUM", offset);
+    case Opcode::OP_GREATER_NUM:
+        return simpleInstruction("OP_GREATER_NUM", offset);
+    case Opcode::OP_LESS_NUM:
+        return simpleInstruction("OP_LESS_NUM", offset);
+    case Opcode::OP_ADD_LOCALS:
+        return twoByteInstruction("OP_ADD_LOCALS", offset);
+    case Opcode::OP_SUBTRACT_LOCALS:
+        return twoByteInstruction("OP_SUBTRACT_LOCALS", offset);
+    case Opcode::OP_MULTIPLY_LOCALS:
+        return twoByteInstruction("OP_MULTIPLY_LOCALS", offset);
+    case Opcode::OP_DIVIDE_LOCALS:
+        return twoByteInstruction("OP_DIVIDE_LOCALS", offset);
+    case Opcode::OP_LESS_LOCAL_CONST_JUMP:
+        return localConstantJumpInstruction("OP_LESS_LOCAL_CONST_JUMP", offset);
+    case Opcode::OP_GREATER_LOCAL_CONST_JUMP:
+        return localConstantJumpInstruction("OP_GREATER_LOCAL_CONST_JUMP", offset);
+    case Opcode::OP_POP_JUMP_IF_FALSE:
+        return jumpInstruction("OP_POP_JUMP_IF_FALSE", 1, offset);
     default:
         std::cout << "Unknown op code " << std::to_string((*chunk)[offset]) << std::endl;
         return offset + 1;
@@ -162,6 +194,34 @@ int Disassembler::invokeInstruction(string name, int offset)
     return offset + 3;
 }
 
+int Disassembler::cachedInstruction(string name, int offset)
+{
+    auto constant = (*chunk)[offset + 1];
+    auto cache = ((*chunk)[offset + 2] << 8) | (*chunk)[offset + 3];
+    printf("%-16s %4d '", name.c_str(), constant);
+    printValue(chunk->getConstant(constant));
+    printf("' ic %d\n", cache);
+    return offset + 4;
+}
+
+int Disassembler::cachedInvokeInstruction(string name, int offset)
+{
+    auto constant = (*chunk)[offset + 1];
+    auto argCount = (*chunk)[offset + 2];
+    auto cache = ((*chunk)[offset + 3] << 8) | (*chunk)[offset + 4];
+    printf("%-16s (%d args) %4d '", name.c_str(), argCount, constant);
+    printValue(chunk->getConstant(constant));
+    printf("' ic %d\n", cache);
+    return offset + 5;
+}
+
+int Disassembler::globalInstruction(string name, int offset)
+{
+    auto slot = ((*chunk)[offset + 1] << 8) | (*chunk)[offset + 2];
+    printf("%-16s %4d\n", name.c_str(), slot);
+    return offset + 3;
+}
+
 int Disassembler::byteInstruction(string name, int offset)
 {
     auto slot = chunk->getCode()[offset + 1];
@@ -169,6 +229,26 @@ int Disassembler::byteInstruction(string name, int offset)
     return offset + 2;
 }
 
+int Disassembler::twoByteInstruction(string name, int offset)
+{
+    auto first = (*chunk)[offset + 1];
+    auto second = (*chunk)[offset + 2];
+    printf("%-16s %4d %4d\n", name.c_str(), first, second);
+    return offset + 3;
+}
+
+int Disassembler::localConstantJumpInstruction(string name, int offset)
+{
+    auto slot = (*chunk)[offset + 1];
+    auto constant = (*chunk)[offset + 2];
+    uint16_t jump = static_cast<uint16_t>((*chunk)[offset + 3] << 8);
+    jump |= (*chunk)[offset + 4];
+    printf("%-16s %4d %4d '", name.c_str(), slot, constant);
+    printValue(chunk->getConstant(constant));
+    printf("' %4d -> %d\n", offset, offset + 5 + jump);
+    return offset + 5;
+}
+
 int Disassembler::jumpInstruction(string name, int sign, int offset)
 {
     uint16_t jump = static_cast<uint16_t>((*chunk)[offset + 1] << 8);
@@ -15,8 +15,13 @@ private:
     int constantInstruction(std::string, int);
     int constantLongInstruction(std::string, int);
     int invokeInstruction(std::string, int);
+    int cachedInstruction(std::string, int);
+    int cachedInvokeInstruction(std::string, int);
     int byteInstruction(std::string, int);
+    int globalInstruction(std::string, int);
     int jumpInstruction(std::string, int, int);
+    int twoByteInstruction(std::string, int);
+    int localConstantJumpInstruction(std::string, int);
     const Chunk *chunk;
 };
 #endif
\ No newline at end of file
@@ -1,78 +1,301 @@
 #include <iostream>
 #include <algorithm>
+#include <thread>
+#include <cstdint>
+#include <fstream>
 #include "gc.hpp"
 #include "vm.hpp"
 #include "object.hpp"
+#include "heapgraph.hpp"
 
 using std::move;
-using std::shared_ptr;
 using std::size_t;
+using std::unique_ptr;
 using std::vector;
+using std::chrono::microseconds;
+using std::chrono::steady_clock;
 
-#define GC_HEAP_GROW_FACTOR 2
+#define GC_SLICE_BYTES (64 * 1024)
+#define GC_SLICE_CHECK_INTERVAL 32
+// Bytes a mark slice blackens per byte allocated since the previous one, and
+// the least it blackens whatever the pause budget.
+#define GC_MARK_ASSIST_RATIO 4
+#define GC_MARK_ASSIST_MIN (64 * 1024)
+// An incremental cycle that lets the heap grow this share past the threshold
+// that started it, or takes this many slices, is finished in one pause.
+#define GC_MARK_OVERSHOOT 0.5
+#define GC_MARK_SLICES_MAX 256
+#define GC_SWEEP_CHUNK 16384
 
-Gc::Gc(Vm *vm) : vm{vm}
+// Deque of the marker running on this thread during a parallel trace.
+static thread_local MarkDeque *localDeque = nullptr;
+
+// Adds the time until the end of the scope to a phase of the statistics.
+class PhaseTimer
+{
+public:
+    explicit PhaseTimer(GcStats *stats, GcPhase phase) : stats{stats}, phase{phase}
+    {
+        if (stats)
+            start = steady_clock::now();
+    }
+
+    ~PhaseTimer()
+    {
+        if (stats)
+            stats->phaseMicros[static_cast<int>(phase)] +=
+                std::chrono::duration<double, std::micro>(steady_clock::now() - start).count();
+    }
+
+private:
+    GcStats *stats;
+    GcPhase phase;
+    steady_clock::time_point start;
+};
+
+Gc::Gc(Vm *vm, GcOptions options)
+    : vm{vm}, options{options}, pacer{options.maxHeapBytes, options.cpuTarget, options.pauseGoalMicros}
+{
+    nextMajorGC = pacer.firstMajorThreshold();
+    if (options.stats || !options.statsJsonPath.empty())
+        statsEnabled = &stats;
+}
+
+void Gc::collectGarbage(bool full)
 {
+    if (marking)
+    {
+        // Objects that died while the cycle ran, or were allocated during it,
+        // survive it as floating garbage, a full collection starts over.
+        if (full)
+        {
+            finishMarking("interrupt marking");
+            majorCollection();
+        }
+        else if (bytesAllocated > nextMajorGC + nextMajorGC * GC_MARK_OVERSHOOT ||
+                 cycleSlices >= GC_MARK_SLICES_MAX)
+            finishMarking("finish marking");
+        else if (!markSlice())
+            finishMajorCollection();
+    }
+    else if (full || bytesAllocated > nextMajorGC)
+    {
+        if (options.incremental && !full)
+            beginMajorCollection();
+        else
+            majorCollection();
+    }
+    else
+    {
+        if (sweeping && sweepBytes > GC_SLICE_BYTES)
+            sweepSlice();
+        if (nurseryFull())
+            minorCollection();
+    }
+
+    if (full)
+        sweepOldObjects(SIZE_MAX);
 }
 
-void Gc::collectGarbage()
+void Gc::minorCollection()
 {
 #ifdef DEBUG_LOG_GC
-    std::cout << "-- gc begin" << std::endl;
+    std::cout << "-- minor gc begin" << std::endl;
     auto before = bytesAllocated;
 #endif
+    auto start = steady_clock::now();
+    auto nurseryBytes = youngBytes;
+    stats.minorCollections++;
 
+    minor = true;
     markRoots();
+    markRememberedSet();
     traceReferences();
     tableRemoveWhite(vm->strings);
-    sweep();
-    nextGC = bytesAllocated * GC_HEAP_GROW_FACTOR;
+    auto survived = sweepNursery();
+    minor = false;
+    youngBytes = 0;
 
+    pacer.minorCollected(endPause("minor collection", start), nurseryBytes, survived);
 #ifdef DEBUG_LOG_GC
-    std::cout << "-- gc end" << std::endl;
+    std::cout << "-- minor gc end" << std::endl;
     std::cout << " collected " << before - bytesAllocated << " bytes ";
-    std::cout << "(from " << before << " to " << bytesAllocated << ") next at ";
-    std::cout << nextGC << std::endl;
+    std::cout << "(from " << before << " to " << bytesAllocated << ")" << std::endl;
 #endif
 }
 
-void Gc::markRoots()
+void Gc::majorCollection()
 {
-    for (Value *slot = &vm->stack[0]; slot < vm->stackTop; slot++)
-    {
-        markValue(*slot);
-    }
+    auto start = steady_clock::now();
+    beginMajorCollection();
+    traceReferences();
+    finishMajorCollection();
+    pacer.majorWork(endPause("major collection", start));
+}
+
+// Incremental marking keeps the tri-color invariant with an insertion
+// barrier: the mutator shades any white object it stores into a marked one
+// (see shade) and objects allocated while marking start out black (see
+// allocateBlack). Minor collections are suspended until the cycle finishes.
+void Gc::beginMajorCollection()
+{
+#ifdef DEBUG_LOG_GC
+    std::cout << "-- major gc begin" << std::endl;
+#endif
+    auto start = steady_clock::now();
+
+    // Survivors of the previous cycle still carry their mark bit.
+    sweepOldObjects(SIZE_MAX);
+    stats.majorCollections++;
+    marking = true;
+    cycleSlices = 0;
+    markRoots();
+    youngBytes = 0;
 
-    for (int i = 0; i < vm->frameCount; i++)
+    if (options.incremental)
+        pacer.majorWork(endPause("mark roots", start));
+}
+
+// Blackens gray objects until both the pause budget is spent and the work
+// owed for the bytes allocated since the last slice is done, returns false
+// once marking is complete. Roots are not behind the barrier, so an empty
+// gray stack is followed by a rescan of the roots, and the cycle only ends
+// when that finds nothing new.
+bool Gc::markSlice()
+{
+    PhaseTimer timer{statsEnabled, GcPhase::TRACE};
+    auto start = steady_clock::now();
+    stats.markSlices++;
+    cycleSlices++;
+    auto budget = microseconds{options.maxPauseMicros};
+    auto quota = std::max<size_t>(youngBytes * GC_MARK_ASSIST_RATIO, GC_MARK_ASSIST_MIN);
+    size_t blackenedBytes = 0;
+    auto blackened = 0;
+
+    while (!grayStack.empty())
     {
-        auto &frame = vm->frames[i];
-        markObject(frame.closure);
+        auto obj = grayStack.back();
+        grayStack.pop_back();
+        blackenObject(obj);
+        blackenedBytes += objectSize(obj);
+
+        if (++blackened % GC_SLICE_CHECK_INTERVAL == 0 && blackenedBytes >= quota &&
+            steady_clock::now() - start >= budget)
+            break;
     }
+    if (grayStack.empty())
+        markRoots();
+    youngBytes = 0;
+
+    pacer.majorWork(endPause("mark slice", start, blackened));
+    return !grayStack.empty();
+}
 
-    for (auto upvalue = vm->openUpvalues; upvalue; upvalue = static_pointer_cast<UpvalueObject>(upvalue->next))
+// Ends an incremental cycle in a single pause, when the mutator outran it
+// or a full collection cannot wait for it.
+void Gc::finishMarking(const char *phase)
+{
+    auto start = steady_clock::now();
+    markRoots();
+    traceReferences();
+    pacer.majorWork(endPause(phase, start));
+    finishMajorCollection();
+}
+
+// Called once every reachable object is marked.
+void Gc::finishMajorCollection()
+{
+    auto start = steady_clock::now();
+#ifdef DEBUG_LOG_GC
+    auto before = bytesAllocated;
+#endif
+
+    tableRemoveWhite(vm->strings);
+    for (auto object : rememberedSet)
     {
-        markObject(upvalue);
+        object->isRemembered = false;
     }
+    rememberedSet.clear();
 
-    markTable(vm->globals);
-    markObject(vm->initString);
+    // The old generation is swept lazily by sweepSlice, the nursery is
+    // promoted right away so minor collections keep working meanwhile.
+    vm->unsweptObjects = vm->oldObjects;
+    vm->oldObjects = nullptr;
+    sweepNursery();
+    marking = false;
+    youngBytes = 0;
+    sweepBytes = 0;
+    nextMajorGC = SIZE_MAX;
+    sweeping = true;
+    // Picks the next threshold at once when the old list was empty.
+    sweepOldObjects(0);
+
+    if (options.incremental)
+        pacer.majorWork(endPause("finish major", start));
+#ifdef DEBUG_LOG_GC
+    std::cout << "-- major gc end" << std::endl;
+    std::cout << " collected " << before - bytesAllocated << " young bytes ";
+    std::cout << "(from " << before << " to " << bytesAllocated << ")" << std::endl;
+#endif
 }
 
-void Gc::markValue(Value &value)
+// Returns the microseconds since start and reports them with --gc-log.
+double Gc::endPause(const char *phase, steady_clock::time_point start, int objects)
 {
-    if (isObject(value))
-        markObject(asObject(value));
+    auto elapsed = std::chrono::duration<double, std::micro>(steady_clock::now() - start).count();
+    if (statsEnabled)
+        stats.addPause(elapsed);
+    if (!options.log)
+        return elapsed;
+
+    std::cerr << "[gc] " << phase << " " << static_cast<long long>(elapsed) << "us";
+    if (objects >= 0)
+        std::cerr << " (" << objects << " objects)";
+    std::cerr << " heap " << bytesAllocated << " bytes" << std::endl;
+    return elapsed;
 }
 
-void Gc::markObject(shared_ptr<Object> obj)
+void Gc::markRoots()
+{
+    PhaseTimer timer{statsEnabled, GcPhase::MARK_ROOTS};
+    forEachRoot([this](const char *, Object *root)
+                { markObject(root); });
+}
+
+// Old objects that were given a young reference are traced without being
+// marked themselves, which is what lets a minor collection skip the rest of
+// the old generation.
+void Gc::markRememberedSet()
+{
+    PhaseTimer timer{statsEnabled, GcPhase::MARK_ROOTS};
+    for (auto object : rememberedSet)
+    {
+        object->isRemembered = false;
+        blackenObject(object);
+    }
+    rememberedSet.clear();
+}
+
+void Gc::markObject(Object *obj)
 {
     if (!obj)
         return;
+    if (parallel)
+    {
+        // Markers race for the object, only the one that sets the bit
+        // traces it.
+        if (std::atomic_ref<bool>{obj->isMarked}.exchange(true, std::memory_order_acq_rel))
+            return;
+        localDeque->push(obj);
+        return;
+    }
     if (obj->isMarked)
         return;
+    if (minor && obj->isOld)
+        return;
 
 #ifdef DEBUG_LOG_GC
-    std::cout << std::to_address(obj.get()) << " mark ";
+    std::cout << obj << " mark ";
     printValue(objectValue(obj));
     std::cout << std::endl;
 #endif
@@ -81,17 +304,15 @@ void Gc::markObject(shared_ptr<Object> obj)
     grayStack.push_back(move(obj));
 }
 
-void Gc::markTable(Table &table)
+void Gc::traceReferences()
 {
-    for (auto &entry : table.entries)
+    PhaseTimer timer{statsEnabled, GcPhase::TRACE};
+    if (options.markThreads > 1 && !minor)
     {
-        markObject(entry.key);
-        markValue(entry.value);
+        parallelTraceReferences();
+        return;
     }
-}
 
-void Gc::traceReferences()
-{
     while (grayStack.size())
     {
         auto obj = grayStack.back();
@@ -100,121 +321,273 @@ void Gc::traceReferences()
     }
 }
 
-void Gc::sweep()
+// The gray objects are dealt round-robin to one deque per marker, markers
+// then trace from their own deque and steal from the others once it runs
+// dry. The set of marked objects does not depend on the interleaving and
+// sweeping stays sequential, so collections free the same objects in the
+// same order as the single threaded trace.
+void Gc::parallelTraceReferences()
+{
+    auto threads = options.markThreads;
+    while (deques.size() < static_cast<size_t>(threads))
+    {
+        deques.push_back(std::make_unique<MarkDeque>());
+    }
+    for (size_t i = 0; i < grayStack.size(); i++)
+    {
+        deques[i % threads]->push(grayStack[i]);
+    }
+    grayStack.clear();
+
+    parallel = true;
+    activeMarkers = threads;
+    vector<std::thread> markers;
+    for (int i = 1; i < threads; i++)
+    {
+        markers.emplace_back(&Gc::markerLoop, this, i);
+    }
+    markerLoop(0);
+    for (auto &marker : markers)
+    {
+        marker.join();
+    }
+    parallel = false;
+
+    for (auto &deque : deques)
+    {
+        deque->reset();
+    }
+}
+
+void Gc::markerLoop(int id)
+{
+    localDeque = deques[id].get();
+    do
+    {
+        while (auto obj = localDeque->take())
+        {
+            blackenObject(obj);
+        }
+    } while (stealWork(id));
+    localDeque = nullptr;
+}
+
+// Steals and blackens one object from another marker. Returns false once
+// every marker is out of work: a marker only goes idle with an empty deque
+// and nobody else pushes to it, so no work can appear after that.
+bool Gc::stealWork(int id)
 {
-    shared_ptr<Object> previous{};
+    auto threads = static_cast<int>(deques.size());
+    activeMarkers--;
+    while (activeMarkers > 0)
+    {
+        for (int i = 1; i < threads; i++)
+        {
+            auto &victim = deques[(id + i) % threads];
+            if (victim->empty())
+                continue;
+
+            activeMarkers++;
+            if (auto obj = victim->steal())
+            {
+                blackenObject(obj);
+                return true;
+            }
+            activeMarkers--;
+        }
+        std::this_thread::yield();
+    }
+    return false;
+}
+
+// Frees the unmarked young objects and moves the survivors to the old list,
+// returns the bytes promoted.
+size_t Gc::sweepNursery()
+{
+    PhaseTimer timer{statsEnabled, GcPhase::SWEEP};
+    size_t promoted = 0;
     auto object = vm->objects;
     while (object)
     {
+        auto next = object->next;
         if (object->isMarked)
         {
             object->isMarked = false;
-            previous = object;
-            object = object->next;
+            object->isOld = true;
+            object->next = vm->oldObjects;
+            vm->oldObjects = object;
+            promoted += objectSize(object);
         }
         else
         {
-            bytesAllocated -= sizeof(*object);
-            object = object->next;
-            if (previous)
-                previous->next = object;
-            else
-                vm->objects = object;
+            auto size = objectSize(object);
+            bytesAllocated -= size;
+            stats.bytesFreed += size;
+            stats.objectsFreed++;
+            if (object->isSampled)
+                vm->profiler->recordFree(object);
+            freeObject(object);
         }
+        object = next;
     }
+    vm->objects = nullptr;
+    return promoted;
 }
 
-void Gc::blackenObject(shared_ptr<Object> obj)
+void Gc::sweepSlice()
 {
-#ifdef DEBUG_LOG_GC
-    std::cout << std::to_address(obj.get()) << " blacken ";
-    printValue(objectValue(obj));
-    std::cout << std::endl;
-#endif
+    auto start = steady_clock::now();
+    stats.sweepSlices++;
+    auto swept = sweepOldObjects(GC_SWEEP_CHUNK);
+    sweepBytes = 0;
+    pacer.majorWork(endPause("sweep slice", start, static_cast<int>(swept)));
+}
 
-    switch (obj->type)
-    {
-    case ObjectType::OBJECT_BOUND_METHOD:
-    {
-        auto boundMethod = static_pointer_cast<BoundMethodObject>(obj);
-        markValue(boundMethod->receiver);
-        markObject(boundMethod->method);
-    }
-    break;
-    case ObjectType::OBJECT_CLASS:
-    {
-        auto klass = static_pointer_cast<ClassObject>(obj);
-        markObject(klass->name);
-        markTable(klass->methods);
-    }
-    break;
-    case ObjectType::OBJECT_INSTANCE:
-    {
-        auto instance = static_pointer_cast<InstanceObject>(obj);
-        markObject(instance->klass);
-        markTable(instance->fields);
-    }
-    break;
-    case ObjectType::OBJECT_CLOSURE:
+// Sweeps up to limit objects left over by the last major collection. Live
+// ones go back to the old list, which is safe to interleave with the
+// mutator: dead objects are unreachable and their strings were already
+// purged from the intern table.
+size_t Gc::sweepOldObjects(size_t limit)
+{
+    if (!sweeping)
+        return 0;
+
+    PhaseTimer timer{statsEnabled, GcPhase::SWEEP};
+    size_t swept = 0;
+    for (; swept < limit && vm->unsweptObjects; swept++)
     {
-        auto closure = static_pointer_cast<ClosureObject>(obj);
-        markObject(closure->function);
-        for (auto upvalue : closure->upvalues)
+        auto object = vm->unsweptObjects;
+        vm->unsweptObjects = object->next;
+        if (object->isMarked)
+        {
+            object->isMarked = false;
+            object->next = vm->oldObjects;
+            vm->oldObjects = object;
+        }
+        else
         {
-            markObject(upvalue);
+            auto size = objectSize(object);
+            bytesAllocated -= size;
+            stats.bytesFreed += size;
+            stats.objectsFreed++;
+            if (object->isSampled)
+                vm->profiler->recordFree(object);
+            freeObject(object);
         }
     }
-    break;
-    case ObjectType::OBJECT_FUNCTION:
+
+    if (!vm->unsweptObjects)
     {
-        auto objFunc = static_pointer_cast<FunctionObject>(obj);
-        markObject(objFunc->name);
-        markValues(objFunc->chunk.constants);
-    }
-    break;
-    case ObjectType::OBJECT_UPVALUE:
-        markValue(static_pointer_cast<UpvalueObject>(obj)->closed);
-        break;
-    case ObjectType::OBJECT_NATIVE:
-    case ObjectType::OBJECT_STRING:
-        break;
-    default:
-        break;
+        sweeping = false;
+        vm->arena.releaseEmptyPages();
+        nextMajorGC = pacer.majorFinished(bytesAllocated, totalAllocated);
+        if (options.log)
+        {
+            std::cerr << "[gc] pacer live " << bytesAllocated << " bytes, allocating ";
+            std::cerr << static_cast<long long>(pacer.allocationRate() * 1e6) << " bytes/s, next major at ";
+            std::cerr << nextMajorGC << " bytes, nursery " << pacer.nurserySize() << " bytes" << std::endl;
+        }
+#ifdef DEBUG_LOG_GC
+        std::cout << "-- sweep end heap " << bytesAllocated << " bytes next at ";
+        std::cout << nextMajorGC << std::endl;
+#endif
     }
+    return swept;
 }
 
-void Gc::markValues(vector<Value> &values)
+void Gc::blackenObject(Object *obj)
 {
-    for (auto &value : values)
-    {
-        markValue(value);
-    }
+#ifdef DEBUG_LOG_GC
+    std::cout << obj << " blacken ";
+    printValue(objectValue(obj));
+    std::cout << std::endl;
+#endif
+
+    forEachReference(obj, [this](Object *reference)
+                     { markObject(reference); });
 }
 
+// Deletes the entries of dead strings in a single pass.
 void Gc::tableRemoveWhite(Table &table)
 {
-    while (true)
-    {
-        auto found = std::find_if(
-            table.entries.begin(),
-            table.entries.end(),
-            [](Entry &entry)
-            { return entry.key && !entry.key->isMarked; });
-
-        if (found == table.entries.end())
-            break;
-
-        auto res = table.deleteKey((*found).key);
-        assert(res == true);
-    }
+    PhaseTimer timer{statsEnabled, GcPhase::REMOVE_WHITE};
+    table.removeIf([this](StringObject *key)
+                   { return !key->isMarked && !(minor && key->isOld); });
 }
 
 void Gc::addToBytesAllocated(size_t bytes)
 {
     bytesAllocated += bytes;
+    youngBytes += bytes;
+    sweepBytes += bytes;
+    totalAllocated += bytes;
+    stats.peakHeapBytes = std::max(stats.peakHeapBytes, bytesAllocated);
+}
+
+// Memory a live object gave back, such as the old storage of a table whose
+// rebuild finished.
+void Gc::releaseBytes(size_t bytes)
+{
+    bytesAllocated -= bytes;
+    stats.bytesFreed += bytes;
 }
 
 bool Gc::shouldCollect()
 {
-    return bytesAllocated > nextGC;
-}
\ No newline at end of file
+    if (marking)
+        return youngBytes > GC_SLICE_BYTES;
+    return nurseryFull() || (sweeping && sweepBytes > GC_SLICE_BYTES);
+}
+
+bool Gc::nurseryFull() const
+{
+    return youngBytes > pacer.nurserySize() && bytesAllocated > pacer.heapFloor();
+}
+
+void Gc::shade(Object *object)
+{
+    markObject(object);
+}
+
+// Marks an object created while marking and shades what it references from
+// the start, so it never needs to be traced.
+void Gc::allocateBlack(Object *object)
+{
+    object->isMarked = true;
+    blackenObject(object);
+}
+
+void Gc::remember(Object *object)
+{
+    if (object->isRemembered)
+        return;
+
+    object->isRemembered = true;
+    rememberedSet.push_back(object);
+}
+void Gc::reportStats()
+{
+    if (!statsEnabled)
+        return;
+
+    for (auto list : {vm->objects, vm->oldObjects, vm->unsweptObjects})
+    {
+        for (auto object = list; object; object = object->next)
+        {
+            auto type = static_cast<int>(object->type);
+            stats.liveObjects[type]++;
+            stats.liveBytes[type] += objectSize(object);
+        }
+    }
+
+    if (options.stats)
+        stats.print(std::cerr);
+    if (!options.statsJsonPath.empty())
+    {
+        std::ofstream out{options.statsJsonPath};
+        if (out)
+            stats.writeJson(out);
+        else
+            std::cerr << "Could not write gc stats to " << options.statsJsonPath << std::endl;
+    }
+}
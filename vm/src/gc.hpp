@@ -1,34 +1,109 @@
 #ifndef _GC_HPP_
 #define _GC_HPP_
 #include <vector>
+#include <string>
 #include <memory>
+#include <chrono>
+#include <atomic>
+#include "markdeque.hpp"
+#include "pacer.hpp"
+#include "gcstats.hpp"
 
 class Vm;
 class Object;
 class Value;
 class Table;
+struct Shape;
 
+struct GcOptions
+{
+    // Spread the marking of major collections over allocation.
+    bool incremental = false;
+    int maxPauseMicros = 1000;
+    // Report every pause on stderr.
+    bool log = false;
+    // Threads tracing the heap during the stop-the-world part of a major
+    // collection, 1 marks on the mutator thread only.
+    int markThreads = 1;
+    // Pacing goals: a soft cap on the heap (0 for none), the share of the
+    // run time the collector may take, and the pause minor collections aim
+    // for (0 keeps the nursery size fixed).
+    std::size_t maxHeapBytes = 0;
+    double cpuTarget = 0.05;
+    int pauseGoalMicros = 0;
+    // Print statistics on exit, and write them as JSON to a file.
+    bool stats = false;
+    std::string statsJsonPath;
+};
+
+// Generational mark-sweep. New objects go to the nursery (Vm::objects) and
+// are promoted to the old list once they survive a minor collection. Minor
+// collections only trace young objects, old objects that were written a
+// young reference since the last collection act as extra roots.
 class Gc
 {
 public:
-    explicit Gc(Vm *);
-    void collectGarbage();
+    explicit Gc(Vm *, GcOptions);
+    void collectGarbage(bool full = false);
     bool shouldCollect();
     void addToBytesAllocated(std::size_t);
+    void releaseBytes(std::size_t);
+    void remember(Object *);
+    void shade(Object *);
+    void allocateBlack(Object *);
+    bool isMarking() const { return marking; }
+    void reportStats();
+    // Defined in heapgraph.hpp.
+    template <typename Visitor>
+    void forEachRoot(Visitor &&);
+    template <typename Visitor>
+    static void forEachReference(Object *, Visitor &&);
 
 private:
+    void minorCollection();
+    void majorCollection();
+    void beginMajorCollection();
+    bool markSlice();
+    void finishMarking(const char *);
+    void finishMajorCollection();
+    double endPause(const char *, std::chrono::steady_clock::time_point, int = -1);
+    bool nurseryFull() const;
     void markRoots();
-    void markValue(Value &);
-    void markObject(std::shared_ptr<Object>);
-    void markTable(Table &);
+    void markRememberedSet();
+    void markObject(Object *);
     void traceReferences();
-    void sweep();
-    void blackenObject(std::shared_ptr<Object>);
-    void markValues(std::vector<Value> &);
+    void parallelTraceReferences();
+    void markerLoop(int);
+    bool stealWork(int);
+    std::size_t sweepNursery();
+    void sweepSlice();
+    std::size_t sweepOldObjects(std::size_t);
+    void blackenObject(Object *);
+    template <typename Visitor>
+    static void forEachEntry(const Table &, Visitor &&);
+    template <typename Visitor>
+    static void forEachShapeName(const Shape &, Visitor &&);
     void tableRemoveWhite(Table &);
     Vm *vm;
-    std::vector<std::shared_ptr<Object>> grayStack;
+    GcOptions options;
+    Pacer pacer;
+    // Points to stats when they are gathered.
+    GcStats *statsEnabled = nullptr;
+    GcStats stats;
+    std::vector<Object *> grayStack;
+    std::vector<Object *> rememberedSet;
+    std::vector<std::unique_ptr<MarkDeque>> deques;
+    std::atomic<int> activeMarkers{0};
+    bool parallel = false;
+    bool minor = false;
+    bool marking = false;
+    bool sweeping = false;
     std::size_t bytesAllocated = 0;
-    int nextGC = 1024 * 1024;
+    std::size_t youngBytes = 0;
+    std::size_t sweepBytes = 0;
+    std::size_t totalAllocated = 0;
+    std::size_t nextMajorGC;
+    // Mark slices run by the current incremental cycle.
+    int cycleSlices = 0;
 };
 #endif
\ No newline at end of file
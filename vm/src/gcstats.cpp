@@ -0,0 +1,100 @@
+#include <cmath>
+#include <algorithm>
+#include <iomanip>
+#include "gcstats.hpp"
+#include "object.hpp"
+
+using std::endl;
+using std::ostream;
+
+static_assert(OBJECT_TYPE_COUNT == static_cast<int>(ObjectType::OBJECT_UPVALUE) + 1);
+
+static const char *phaseNames[GC_PHASE_COUNT] = {"mark_roots", "trace", "remove_white", "sweep"};
+
+const char *objectTypeNames[OBJECT_TYPE_COUNT] = {
+    "bound_method", "class", "closure", "function", "instance", "native", "string", "upvalue"};
+
+// Lower bound in microseconds of a histogram bucket, bucket 0 holds pauses
+// under a microsecond.
+inline long long bucketStart(int bucket)
+{
+    return bucket ? 1LL << (bucket - 1) : 0;
+}
+
+void GcStats::addPause(double micros)
+{
+    auto bucket = micros < 1 ? 0 : std::min(static_cast<int>(std::log2(micros)) + 1, PAUSE_BUCKETS - 1);
+    pauses[bucket]++;
+    pauseCount++;
+    totalPauseMicros += micros;
+    maxPauseMicros = std::max(maxPauseMicros, micros);
+}
+
+void GcStats::print(ostream &out) const
+{
+    out << std::fixed << std::setprecision(3);
+    out << "== gc stats ==" << endl;
+    out << "collections: " << minorCollections << " minor, " << majorCollections << " major (";
+    out << markSlices << " mark slices, " << sweepSlices << " sweep slices)" << endl;
+    out << "phase times:" << endl;
+    for (int i = 0; i < GC_PHASE_COUNT; i++)
+    {
+        out << "  " << std::left << std::setw(14) << phaseNames[i] << std::right;
+        out << phaseMicros[i] / 1000 << " ms" << endl;
+    }
+    out << "freed: " << objectsFreed << " objects, " << bytesFreed << " bytes" << endl;
+    out << "peak heap: " << peakHeapBytes << " bytes" << endl;
+    out << "live objects:" << endl;
+    for (int i = 0; i < OBJECT_TYPE_COUNT; i++)
+    {
+        if (!liveObjects[i])
+            continue;
+        out << "  " << std::left << std::setw(14) << objectTypeNames[i] << std::right;
+        out << std::setw(10) << liveObjects[i] << std::setw(14) << liveBytes[i] << " bytes" << endl;
+    }
+    out << "pauses: " << pauseCount << ", total " << totalPauseMicros / 1000 << " ms, max ";
+    out << maxPauseMicros / 1000 << " ms" << endl;
+    for (int i = 0; i < PAUSE_BUCKETS; i++)
+    {
+        if (!pauses[i])
+            continue;
+        out << "  >= " << std::setw(8) << bucketStart(i) << " us " << std::setw(10) << pauses[i] << endl;
+    }
+    out << std::defaultfloat;
+}
+
+void GcStats::writeJson(ostream &out) const
+{
+    out << std::fixed << std::setprecision(3);
+    out << "{" << endl;
+    out << "  \"collections\": {\"minor\": " << minorCollections << ", \"major\": " << majorCollections;
+    out << ", \"mark_slices\": " << markSlices << ", \"sweep_slices\": " << sweepSlices << "}," << endl;
+    out << "  \"phase_us\": {";
+    for (int i = 0; i < GC_PHASE_COUNT; i++)
+    {
+        out << (i ? ", " : "") << "\"" << phaseNames[i] << "\": " << phaseMicros[i];
+    }
+    out << "}," << endl;
+    out << "  \"freed\": {\"objects\": " << objectsFreed << ", \"bytes\": " << bytesFreed << "}," << endl;
+    out << "  \"peak_heap_bytes\": " << peakHeapBytes << "," << endl;
+    out << "  \"live\": {";
+    for (int i = 0; i < OBJECT_TYPE_COUNT; i++)
+    {
+        out << (i ? ", " : "") << "\"" << objectTypeNames[i] << "\": {\"objects\": " << liveObjects[i];
+        out << ", \"bytes\": " << liveBytes[i] << "}";
+    }
+    out << "}," << endl;
+    out << "  \"pauses\": {\"count\": " << pauseCount << ", \"total_us\": " << totalPauseMicros;
+    out << ", \"max_us\": " << maxPauseMicros << ", \"histogram\": [";
+    auto first = true;
+    for (int i = 0; i < PAUSE_BUCKETS; i++)
+    {
+        if (!pauses[i])
+            continue;
+        out << (first ? "" : ", ") << "{\"min_us\": " << bucketStart(i) << ", \"count\": " << pauses[i] << "}";
+        first = false;
+    }
+    out << "]}" << endl;
+    out << "}" << endl;
+    out << std::defaultfloat;
+}
@@ -0,0 +1,49 @@
+#ifndef _GCSTATS_HPP_
+#define _GCSTATS_HPP_
+#include <array>
+#include <ostream>
+#include <cstddef>
+
+#define OBJECT_TYPE_COUNT 8
+// Pause histogram buckets are powers of two microseconds, the last one
+// collects everything from about a second up.
+#define PAUSE_BUCKETS 21
+
+enum class GcPhase
+{
+    MARK_ROOTS,
+    TRACE,
+    REMOVE_WHITE,
+    SWEEP,
+};
+
+#define GC_PHASE_COUNT 4
+
+// Names of the object types in ObjectType order.
+extern const char *objectTypeNames[OBJECT_TYPE_COUNT];
+
+// Telemetry of the collector, gathered when --gc-stats or --gc-stats-json
+// asks for it and reported when the Vm exits.
+struct GcStats
+{
+    void addPause(double micros);
+    void print(std::ostream &) const;
+    void writeJson(std::ostream &) const;
+
+    std::size_t minorCollections = 0;
+    std::size_t majorCollections = 0;
+    std::size_t markSlices = 0;
+    std::size_t sweepSlices = 0;
+    std::array<double, GC_PHASE_COUNT> phaseMicros{};
+    std::size_t objectsFreed = 0;
+    std::size_t bytesFreed = 0;
+    std::size_t peakHeapBytes = 0;
+    // Filled in from the heap right before reporting.
+    std::array<std::size_t, OBJECT_TYPE_COUNT> liveObjects{};
+    std::array<std::size_t, OBJECT_TYPE_COUNT> liveBytes{};
+    std::array<std::size_t, PAUSE_BUCKETS> pauses{};
+    std::size_t pauseCount = 0;
+    double totalPauseMicros = 0;
+    double maxPauseMicros = 0;
+};
+#endif
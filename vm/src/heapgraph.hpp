@@ -0,0 +1,156 @@
+#ifndef _HEAPGRAPH_HPP_
+#define _HEAPGRAPH_HPP_
+#include "gc.hpp"
+#include "vm.hpp"
+#include "object.hpp"
+
+// The edges of the object graph. The Gc marks through them and heap
+// snapshots record them, so both see the same heap.
+
+template <typename Visitor>
+void Gc::forEachRoot(Visitor &&visit)
+{
+    for (Value *slot = vm->stack.data(); slot < vm->stackTop; slot++)
+    {
+        if (isObject(*slot))
+            visit("stack", asObject(*slot));
+    }
+
+    for (int i = 0; i < vm->frameCount; i++)
+    {
+        visit("frame", vm->frames[i].closure);
+    }
+
+    for (auto upvalue = vm->openUpvalues; upvalue; upvalue = upvalue->nextUpvalue)
+    {
+        visit("upvalue", upvalue);
+    }
+
+    for (auto &global : vm->globals)
+    {
+        if (isObject(global.value))
+            visit("global", asObject(global.value));
+    }
+    forEachEntry(vm->globalSlots, [&](Object *object)
+                 { visit("global", object); });
+    if (vm->initString)
+        visit("vm", vm->initString);
+}
+
+template <typename Visitor>
+void Gc::forEachReference(Object *obj, Visitor &&visit)
+{
+    auto visitValue = [&](const Value &value)
+    {
+        if (isObject(value))
+            visit(asObject(value));
+    };
+
+    switch (obj->type)
+    {
+    case ObjectType::OBJECT_BOUND_METHOD:
+    {
+        auto boundMethod = static_cast<BoundMethodObject *>(obj);
+        visitValue(boundMethod->receiver);
+        visit(boundMethod->method);
+    }
+    break;
+    case ObjectType::OBJECT_CLASS:
+    {
+        auto klass = static_cast<ClassObject *>(obj);
+        visit(klass->name);
+        forEachEntry(klass->methods, visit);
+        forEachShapeName(klass->rootShape, visit);
+    }
+    break;
+    case ObjectType::OBJECT_INSTANCE:
+    {
+        auto instance = static_cast<InstanceObject *>(obj);
+        visit(instance->klass);
+        for (auto &field : instance->fields)
+        {
+            visitValue(field);
+        }
+    }
+    break;
+    case ObjectType::OBJECT_CLOSURE:
+    {
+        auto closure = static_cast<ClosureObject *>(obj);
+        visit(closure->function);
+        for (auto upvalue : closure->upvalues)
+        {
+            if (upvalue)
+                visit(upvalue);
+        }
+    }
+    break;
+    case ObjectType::OBJECT_FUNCTION:
+    {
+        auto function = static_cast<FunctionObject *>(obj);
+        if (function->name)
+            visit(function->name);
+        for (auto &constant : function->chunk.constants)
+        {
+            visitValue(constant);
+        }
+        for (auto &cache : function->chunk.caches)
+        {
+            for (int i = 0; i < cache.count; i++)
+            {
+                if (cache.entries[i].klass)
+                    visit(cache.entries[i].klass);
+                if (cache.entries[i].method)
+                    visit(cache.entries[i].method);
+            }
+        }
+    }
+    break;
+    case ObjectType::OBJECT_UPVALUE:
+        visitValue(static_cast<UpvalueObject *>(obj)->closed);
+        break;
+    case ObjectType::OBJECT_STRING:
+    {
+        auto string = static_cast<StringObject *>(obj);
+        if (string->isRope())
+        {
+            visit(string->left);
+            visit(string->right);
+        }
+    }
+    break;
+    case ObjectType::OBJECT_NATIVE:
+        break;
+    }
+}
+
+template <typename Visitor>
+void Gc::forEachEntry(const Table &table, Visitor &&visit)
+{
+    table.forEach([&](StringObject *key, const Value &value)
+                  {
+                      visit(key);
+                      if (isObject(value))
+                          visit(asObject(value));
+                  });
+}
+
+// The tree is as deep as an instance has fields, so it is walked with a
+// worklist rather than recursion.
+template <typename Visitor>
+void Gc::forEachShapeName(const Shape &root, Visitor &&visit)
+{
+    std::vector<const Shape *> pending{&root};
+    while (!pending.empty())
+    {
+        auto shape = pending.back();
+        pending.pop_back();
+        if (!shape->names.empty())
+            visit(shape->names.back());
+
+        for (auto &transition : shape->transitions)
+        {
+            pending.push_back(transition.get());
+        }
+    }
+}
+#endif
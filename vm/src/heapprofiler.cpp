@@ -0,0 +1,74 @@
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include "heapprofiler.hpp"
+#include "object.hpp"
+
+using std::size_t;
+using std::string;
+
+HeapProfiler::HeapProfiler(string path, size_t sampleRate)
+    : path{std::move(path)}, sampleRate{sampleRate}, interval{1.0 / sampleRate}
+{
+    bytesUntilSample = static_cast<long long>(interval(random));
+}
+
+// Sampling points are exponentially distributed over the allocated bytes,
+// so allocations of every size are caught in proportion to their bytes.
+bool HeapProfiler::shouldSample(size_t bytes)
+{
+    bytesUntilSample -= bytes;
+    if (bytesUntilSample > 0)
+        return false;
+
+    bytesUntilSample = static_cast<long long>(interval(random));
+    return true;
+}
+
+void HeapProfiler::recordAllocation(Object *object, size_t bytes, const string &stack)
+{
+    // An allocation of size bytes is sampled with probability 1 - e^(-size/rate).
+    auto objects = 1 / (1 - std::exp(-static_cast<double>(bytes) / sampleRate));
+    auto &site = sites[stack];
+    site.allocatedBytes += bytes * objects;
+    site.allocatedObjects += objects;
+    site.liveBytes += bytes * objects;
+    site.liveObjects += objects;
+    samples[object] = Sample{&site, bytes * objects, objects};
+    object->isSampled = true;
+}
+
+void HeapProfiler::recordFree(Object *object)
+{
+    auto found = samples.find(object);
+    if (found == samples.end())
+        return;
+
+    auto &sample = found->second;
+    sample.site->liveBytes -= sample.bytes;
+    sample.site->liveObjects -= sample.objects;
+    samples.erase(found);
+}
+
+void HeapProfiler::write() const
+{
+    writeFolded(path + ".live.folded", true);
+    writeFolded(path + ".alloc.folded", false);
+}
+
+void HeapProfiler::writeFolded(const string &filename, bool live) const
+{
+    std::ofstream out{filename};
+    if (!out)
+    {
+        std::cerr << "Could not write heap profile " << filename << std::endl;
+        return;
+    }
+
+    for (auto &[stack, site] : sites)
+    {
+        auto bytes = std::llround(live ? site.liveBytes : site.allocatedBytes);
+        if (bytes > 0)
+            out << stack << " " << bytes << std::endl;
+    }
+}
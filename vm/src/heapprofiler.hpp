@@ -0,0 +1,54 @@
+#ifndef _HEAPPROFILER_HPP_
+#define _HEAPPROFILER_HPP_
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <unordered_map>
+
+struct Object;
+
+#define HEAP_PROFILE_RATE (512 * 1024)
+
+// Samples allocations about once every sampleRate bytes and attributes them
+// to the Lox call stack that made them. Each sample stands for the bytes
+// expected between two samples, so the totals estimate the whole heap. On
+// exit the live and the total allocations are written as folded stacks,
+// which flamegraph.pl and speedscope read directly and pprof can import.
+class HeapProfiler
+{
+public:
+    explicit HeapProfiler(std::string path, std::size_t sampleRate);
+    bool shouldSample(std::size_t);
+    void recordAllocation(Object *, std::size_t, const std::string &);
+    void recordFree(Object *);
+    void write() const;
+
+private:
+    struct Site
+    {
+        double allocatedBytes = 0;
+        double allocatedObjects = 0;
+        double liveBytes = 0;
+        double liveObjects = 0;
+    };
+
+    struct Sample
+    {
+        Site *site;
+        double bytes;
+        double objects;
+    };
+
+    void writeFolded(const std::string &, bool) const;
+    std::string path;
+    std::size_t sampleRate;
+    long long bytesUntilSample;
+    std::mt19937_64 random;
+    std::exponential_distribution<double> interval;
+    // Keyed by the folded stack, ordered so the files are stable.
+    std::map<std::string, Site> sites;
+    std::unordered_map<Object *, Sample> samples;
+};
+#endif
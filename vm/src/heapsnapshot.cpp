@@ -0,0 +1,87 @@
+#include <fstream>
+#include <iostream>
+#include "heapsnapshot.hpp"
+#include "heapgraph.hpp"
+#include "gcstats.hpp"
+
+using std::ostream;
+using std::string;
+
+#define SNAPSHOT_LABEL_MAX 64
+
+volatile std::sig_atomic_t heapSnapshotRequested = 0;
+
+void requestHeapSnapshot(int)
+{
+    heapSnapshotRequested = 1;
+}
+
+HeapSnapshot::HeapSnapshot(Vm *vm) : vm{vm}
+{
+}
+
+bool HeapSnapshot::write(const string &path)
+{
+    std::ofstream out{path};
+    if (!out)
+    {
+        std::cerr << "Could not write heap snapshot " << path << std::endl;
+        return false;
+    }
+
+    out << "vlox-heap-snapshot " << HEAP_SNAPSHOT_VERSION << "\n";
+    vm->gc.forEachRoot([&](const char *kind, Object *root)
+                       { out << "root " << kind << " " << root << "\n"; });
+
+    for (auto object = vm->objects; object; object = object->next)
+    {
+        writeObject(out, object);
+    }
+    for (auto object = vm->oldObjects; object; object = object->next)
+    {
+        writeObject(out, object);
+    }
+    // Unmarked objects the lazy sweep has not reached yet are dead and may
+    // point to objects that are already freed.
+    for (auto object = vm->unsweptObjects; object; object = object->next)
+    {
+        if (object->isMarked)
+            writeObject(out, object);
+    }
+    return static_cast<bool>(out.flush());
+}
+
+void HeapSnapshot::writeObject(ostream &out, Object *object)
+{
+    std::vector<Object *> references;
+    Gc::forEachReference(object, [&](Object *reference)
+                         { references.push_back(reference); });
+
+    out << "object " << object << " " << objectTypeNames[static_cast<int>(object->type)] << " "
+        << objectSize(object) << " " << references.size();
+    for (auto reference : references)
+    {
+        out << " " << reference;
+    }
+
+    // The label is the rest of the line. Ropes are not flattened for it.
+    std::string label;
+    auto string = object->type == ObjectType::OBJECT_STRING ? static_cast<StringObject *>(object) : nullptr;
+    if (string && string->isRope())
+        label = "<rope of " + std::to_string(string->length) + " characters>";
+    else
+        label = strObject(object);
+    if (label.size() > SNAPSHOT_LABEL_MAX)
+        label = label.substr(0, SNAPSHOT_LABEL_MAX) + "...";
+    out << " ";
+    for (auto c : label)
+    {
+        if (c == '\n')
+            out << "\\n";
+        else if (c == '\\')
+            out << "\\\\";
+        else
+            out << c;
+    }
+    out << "\n";
+}
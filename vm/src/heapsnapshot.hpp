@@ -0,0 +1,34 @@
+#ifndef _HEAPSNAPSHOT_HPP_
+#define _HEAPSNAPSHOT_HPP_
+#include <csignal>
+#include <string>
+#include <ostream>
+
+class Vm;
+struct Object;
+
+#define HEAP_SNAPSHOT_VERSION 1
+
+// Set by SIGUSR1, the Vm writes a snapshot at its next allocation.
+extern volatile std::sig_atomic_t heapSnapshotRequested;
+void requestHeapSnapshot(int);
+
+// Writes every object with its type, shallow size and references, and the
+// roots the Gc marks from, one record per line:
+//
+//   vlox-heap-snapshot <version>
+//   root <kind> <address>
+//   object <address> <type> <size> <count> <address>... <label>
+//
+// vlox-heap reads it and computes retained sizes.
+class HeapSnapshot
+{
+public:
+    explicit HeapSnapshot(Vm *);
+    bool write(const std::string &);
+
+private:
+    void writeObject(std::ostream &, Object *);
+    Vm *vm;
+};
+#endif
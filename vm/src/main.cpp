@@ -3,6 +3,9 @@
 #include <fstream>
 #include <sstream>
 #include <exception>
+#include <cstdlib>
+#include <utility>
+#include <csignal>
 #include "chunk.hpp"
 #include "disassembler.hpp"
 #include "vm.hpp"
@@ -34,23 +37,152 @@ std::string readFile(char *filename)
     return content.str();
 }
 
+void usage()
+{
+    std::cout << "Usage: vlox [options] [filename]" << std::endl;
+    std::cout << "  --gc-incremental      mark major collections incrementally" << std::endl;
+    std::cout << "  --gc-max-pause=<us>   time budget of an incremental mark slice" << std::endl;
+    std::cout << "  --gc-threads=<n>      mark major collections with n threads" << std::endl;
+    std::cout << "  --gc-heap-max=<MiB>   heap size the pacer keeps collections under" << std::endl;
+    std::cout << "  --gc-cpu-target=<%>   share of the run time the collector may take" << std::endl;
+    std::cout << "  --gc-pause-goal=<us>  size the nursery for minor pauses of this length" << std::endl;
+    std::cout << "  --gc-log              report collector pauses on stderr" << std::endl;
+    std::cout << "  --gc-stats            print collector statistics on exit" << std::endl;
+    std::cout << "  --gc-stats-json=<file> write collector statistics as JSON on exit" << std::endl;
+    std::cout << "  --heap-profile=<prefix> write sampled allocation sites to <prefix>.live.folded" << std::endl;
+    std::cout << "                        and <prefix>.alloc.folded on exit" << std::endl;
+    std::cout << "  --heap-profile-rate=<bytes> mean bytes allocated between samples" << std::endl;
+    std::cout << "  --max-frames=<n>      call depth at which a stack overflow is reported" << std::endl;
+    std::cout << "The pacing options can also be set with VLOX_GC_HEAP_MAX, VLOX_GC_CPU_TARGET" << std::endl;
+    std::cout << "and VLOX_GC_PAUSE_GOAL." << std::endl;
+    std::cout << "SIGUSR1 writes a heap snapshot to vlox-<pid>-<n>.heapsnapshot." << std::endl;
+    std::exit(65);
+}
+
+int parseNumber(const std::string &value)
+{
+    try
+    {
+        std::size_t end;
+        auto number = std::stoi(value, &end);
+        if (end != value.size())
+            usage();
+        return number;
+    }
+    catch (const std::exception &)
+    {
+        usage();
+        return 0;
+    }
+}
+
+int parseNumberOption(const std::string &arg)
+{
+    return parseNumber(arg.substr(arg.find('=') + 1));
+}
+
+// Sets a pacing goal from its environment variable or command line value.
+void setPacingOption(GcOptions &gcOptions, const std::string &name, int value)
+{
+    if (value < 0)
+        usage();
+
+    if (name == "heap-max")
+        gcOptions.maxHeapBytes = static_cast<std::size_t>(value) * 1024 * 1024;
+    else if (name == "cpu-target")
+    {
+        if (value < 1 || value > 99)
+            usage();
+        gcOptions.cpuTarget = value / 100.0;
+    }
+    else if (name == "pause-goal")
+        gcOptions.pauseGoalMicros = value;
+}
+
+void readEnvironment(GcOptions &gcOptions)
+{
+    const std::pair<const char *, const char *> variables[] = {
+        {"VLOX_GC_HEAP_MAX", "heap-max"},
+        {"VLOX_GC_CPU_TARGET", "cpu-target"},
+        {"VLOX_GC_PAUSE_GOAL", "pause-goal"},
+    };
+    for (auto [variable, name] : variables)
+    {
+        if (auto value = std::getenv(variable))
+            setPacingOption(gcOptions, name, parseNumber(value));
+    }
+}
+
 int main(int argc, char *argv[])
 {
-    Vm vm;
-    if (argc == 1)
+    GcOptions gcOptions;
+    readEnvironment(gcOptions);
+    std::string heapProfilePath;
+    int heapProfileRate = HEAP_PROFILE_RATE;
+    int maxFrames = FRAMES_MAX;
+    char *filename = nullptr;
+    for (int i = 1; i < argc; i++)
     {
-        repl(vm);
+        std::string arg = argv[i];
+        if (arg == "--gc-incremental")
+            gcOptions.incremental = true;
+        else if (arg.starts_with("--gc-max-pause="))
+        {
+            gcOptions.maxPauseMicros = parseNumberOption(arg);
+            if (gcOptions.maxPauseMicros < 0)
+                usage();
+        }
+        else if (arg.starts_with("--gc-threads="))
+        {
+            gcOptions.markThreads = parseNumberOption(arg);
+            if (gcOptions.markThreads < 1)
+                usage();
+        }
+        else if (arg.starts_with("--gc-heap-max=") || arg.starts_with("--gc-cpu-target=") ||
+                 arg.starts_with("--gc-pause-goal="))
+            setPacingOption(gcOptions, arg.substr(5, arg.find('=') - 5), parseNumberOption(arg));
+        else if (arg == "--gc-log")
+            gcOptions.log = true;
+        else if (arg == "--gc-stats")
+            gcOptions.stats = true;
+        else if (arg.starts_with("--gc-stats-json="))
+            gcOptions.statsJsonPath = arg.substr(arg.find('=') + 1);
+        else if (arg.starts_with("--heap-profile="))
+            heapProfilePath = arg.substr(arg.find('=') + 1);
+        else if (arg.starts_with("--heap-profile-rate="))
+        {
+            heapProfileRate = parseNumberOption(arg);
+            if (heapProfileRate < 1)
+                usage();
+        }
+        else if (arg.starts_with("--max-frames="))
+        {
+            maxFrames = parseNumberOption(arg);
+            if (maxFrames < 1)
+                usage();
+        }
+        else if (arg.starts_with("--") || filename)
+            usage();
+        else
+            filename = argv[i];
     }
-    else if (argc == 2)
+
+#ifdef SIGUSR1
+    std::signal(SIGUSR1, requestHeapSnapshot);
+#endif
+    Vm vm{gcOptions};
+    vm.setMaxFrames(maxFrames);
+    if (!heapProfilePath.empty())
+        vm.enableHeapProfile(heapProfilePath, heapProfileRate);
+    if (!filename)
     {
-        auto content = readFile(argv[1]);
-        vm.interpret(content);
+        repl(vm);
     }
     else
     {
-        std::cout << "Usage: vlox [filename]" << std::endl;
-        std::exit(65);
+        auto content = readFile(filename);
+        vm.interpret(content);
     }
 
     return 0;
-}
\ No newline at end of file
+}
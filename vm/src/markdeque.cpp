@@ -0,0 +1,107 @@
+#include "markdeque.hpp"
+
+using std::int64_t;
+using std::memory_order_acquire;
+using std::memory_order_relaxed;
+using std::memory_order_release;
+using std::memory_order_seq_cst;
+
+#define MARK_DEQUE_INITIAL_CAPACITY 1024
+
+MarkDeque::Buffer::Buffer(int64_t capacity)
+    : capacity{capacity}, slots{new std::atomic<Object *>[capacity]}
+{
+}
+
+Object *MarkDeque::Buffer::get(int64_t index) const
+{
+    return slots[index & (capacity - 1)].load(memory_order_relaxed);
+}
+
+void MarkDeque::Buffer::put(int64_t index, Object *object)
+{
+    slots[index & (capacity - 1)].store(object, memory_order_relaxed);
+}
+
+MarkDeque::MarkDeque()
+{
+    buffers.push_back(std::make_unique<Buffer>(MARK_DEQUE_INITIAL_CAPACITY));
+    buffer.store(buffers.back().get(), memory_order_relaxed);
+}
+
+void MarkDeque::push(Object *object)
+{
+    auto b = bottom.load(memory_order_relaxed);
+    auto t = top.load(memory_order_acquire);
+    auto current = buffer.load(memory_order_relaxed);
+    if (b - t > current->capacity - 1)
+        current = grow(current, t, b);
+
+    current->put(b, object);
+    std::atomic_thread_fence(memory_order_release);
+    bottom.store(b + 1, memory_order_relaxed);
+}
+
+Object *MarkDeque::take()
+{
+    auto b = bottom.load(memory_order_relaxed) - 1;
+    auto current = buffer.load(memory_order_relaxed);
+    bottom.store(b, memory_order_relaxed);
+    std::atomic_thread_fence(memory_order_seq_cst);
+    auto t = top.load(memory_order_relaxed);
+
+    if (t > b)
+    {
+        bottom.store(b + 1, memory_order_relaxed);
+        return nullptr;
+    }
+
+    auto object = current->get(b);
+    if (t == b)
+    {
+        // Last element, race the thieves for it.
+        if (!top.compare_exchange_strong(t, t + 1, memory_order_seq_cst, memory_order_relaxed))
+            object = nullptr;
+        bottom.store(b + 1, memory_order_relaxed);
+    }
+    return object;
+}
+
+Object *MarkDeque::steal()
+{
+    auto t = top.load(memory_order_acquire);
+    std::atomic_thread_fence(memory_order_seq_cst);
+    auto b = bottom.load(memory_order_acquire);
+    if (t >= b)
+        return nullptr;
+
+    auto object = buffer.load(memory_order_acquire)->get(t);
+    if (!top.compare_exchange_strong(t, t + 1, memory_order_seq_cst, memory_order_relaxed))
+        return nullptr;
+    return object;
+}
+
+bool MarkDeque::empty() const
+{
+    return top.load(memory_order_acquire) >= bottom.load(memory_order_acquire);
+}
+
+// Only called between collections, when no thief is running.
+void MarkDeque::reset()
+{
+    buffers.erase(buffers.begin(), buffers.end() - 1);
+    top.store(0, memory_order_relaxed);
+    bottom.store(0, memory_order_relaxed);
+}
+
+MarkDeque::Buffer *MarkDeque::grow(Buffer *current, int64_t t, int64_t b)
+{
+    buffers.push_back(std::make_unique<Buffer>(current->capacity * 2));
+    auto grown = buffers.back().get();
+    for (auto i = t; i < b; i++)
+    {
+        grown->put(i, current->get(i));
+    }
+    buffer.store(grown, memory_order_release);
+    return grown;
+}
@@ -0,0 +1,39 @@
+#ifndef _MARKDEQUE_HPP_
+#define _MARKDEQUE_HPP_
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <cstdint>
+
+struct Object;
+
+// Chase-Lev work-stealing deque of gray objects. The owning thread pushes
+// and takes at the bottom, other markers steal from the top. Buffers
+// replaced by a grow are kept until reset since a thief may still read them.
+class MarkDeque
+{
+public:
+    explicit MarkDeque();
+    void push(Object *);
+    Object *take();
+    Object *steal();
+    bool empty() const;
+    void reset();
+
+private:
+    struct Buffer
+    {
+        explicit Buffer(std::int64_t capacity);
+        Object *get(std::int64_t index) const;
+        void put(std::int64_t index, Object *);
+        std::int64_t capacity;
+        std::unique_ptr<std::atomic<Object *>[]> slots;
+    };
+
+    Buffer *grow(Buffer *, std::int64_t, std::int64_t);
+    std::atomic<std::int64_t> top{0};
+    std::atomic<std::int64_t> bottom{0};
+    std::atomic<Buffer *> buffer;
+    std::vector<std::unique_ptr<Buffer>> buffers;
+};
+#endif
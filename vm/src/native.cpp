@@ -1,9 +1,18 @@
 #include <chrono>
 #include "value.hpp"
+#include "vm.hpp"
 
 Value clockNative(int argCount, Value *args)
 {
     auto now = std::chrono::system_clock::now();
     auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(now.time_since_epoch()).count();
     return numberValue(static_cast<double>(ms));
+}
+
+// heapSnapshot(path) writes a heap snapshot, returns whether it succeeded.
+Value heapSnapshotNative(int argCount, Value *args)
+{
+    if (argCount != 1 || !isString(args[0]))
+        return boolValue(false);
+    return boolValue(Vm::current->writeHeapSnapshot(strValue(args[0])));
 }
\ No newline at end of file
@@ -3,5 +3,6 @@
 #include "value.hpp"
 
 Value clockNative(int, Value *);
+Value heapSnapshotNative(int, Value *);
 
 #endif
\ No newline at end of file
@@ -1,21 +1,172 @@
 #include <iostream>
 #include <utility>
 #include <memory>
+#include <cstring>
 #include "object.hpp"
 
-using std::shared_ptr;
+using std::move;
 using std::string;
 using std::uint32_t;
+using std::uint64_t;
+using std::uint8_t;
 
-uint32_t hashString(const string &str)
+// wyhash (final version 4), public domain by Wang Yi. It reads 8 bytes at a
+// time and mixes them with 64x64->128 bit multiplies, long strings go
+// through three independent lanes the CPU overlaps.
+static const uint64_t wySecret[4] = {0x2d358dccaa6c78a5ull, 0x8bb84b93962eacc9ull, 0x4b33a62ed433d4a3ull,
+                                     0x4d5a2da51de1aa47ull};
+
+inline void wyMultiply(uint64_t &a, uint64_t &b)
+{
+#ifdef __SIZEOF_INT128__
+    auto product = static_cast<__uint128_t>(a) * b;
+    a = static_cast<uint64_t>(product);
+    b = static_cast<uint64_t>(product >> 64);
+#else
+    uint64_t ha = a >> 32, hb = b >> 32, la = static_cast<uint32_t>(a), lb = static_cast<uint32_t>(b);
+    uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb, t = rl + (rm0 << 32);
+    uint64_t carry = t < rl;
+    uint64_t lo = t + (rm1 << 32);
+    carry += lo < t;
+    uint64_t hi = rh + (rm0 >> 32) + (rm1 >> 32) + carry;
+    a = lo;
+    b = hi;
+#endif
+}
+
+inline uint64_t wyMix(uint64_t a, uint64_t b)
+{
+    wyMultiply(a, b);
+    return a ^ b;
+}
+
+inline uint64_t read8(const uint8_t *p)
+{
+    uint64_t value;
+    std::memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+inline uint64_t read4(const uint8_t *p)
 {
-    uint32_t hash = 2166136261u;
-    for (int i = 0; i < str.size(); i++)
+    uint32_t value;
+    std::memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+uint32_t hashString(std::string_view str)
+{
+    auto p = reinterpret_cast<const uint8_t *>(str.data());
+    auto length = str.size();
+    uint64_t seed = wyMix(wySecret[0], wySecret[1]);
+    uint64_t a, b;
+    if (length <= 16)
+    {
+        if (length >= 4)
+        {
+            auto offset = (length >> 3) << 2;
+            a = (read4(p) << 32) | read4(p + offset);
+            b = (read4(p + length - 4) << 32) | read4(p + length - 4 - offset);
+        }
+        else if (length > 0)
+        {
+            a = (static_cast<uint64_t>(p[0]) << 16) | (static_cast<uint64_t>(p[length >> 1]) << 8) | p[length - 1];
+            b = 0;
+        }
+        else
+            a = b = 0;
+    }
+    else
     {
-        hash ^= static_cast<uint8_t>(str[i]);
-        hash *= 16777619;
+        auto remaining = length;
+        if (remaining > 48)
+        {
+            auto seed1 = seed, seed2 = seed;
+            do
+            {
+                seed = wyMix(read8(p) ^ wySecret[1], read8(p + 8) ^ seed);
+                seed1 = wyMix(read8(p + 16) ^ wySecret[2], read8(p + 24) ^ seed1);
+                seed2 = wyMix(read8(p + 32) ^ wySecret[3], read8(p + 40) ^ seed2);
+                p += 48;
+                remaining -= 48;
+            } while (remaining > 48);
+            seed ^= seed1 ^ seed2;
+        }
+        while (remaining > 16)
+        {
+            seed = wyMix(read8(p) ^ wySecret[1], read8(p + 8) ^ seed);
+            p += 16;
+            remaining -= 16;
+        }
+        a = read8(p + remaining - 16);
+        b = read8(p + remaining - 8);
+    }
+    a ^= wySecret[1];
+    b ^= seed;
+    wyMultiply(a, b);
+    return static_cast<uint32_t>(wyMix(a ^ wySecret[0] ^ length, b ^ wySecret[1]));
+}
+
+int Shape::findSlot(const StringObject *name) const
+{
+    for (std::size_t slot = 0; slot < names.size(); slot++)
+    {
+        if (names[slot] == name)
+            return static_cast<int>(slot);
+    }
+    return -1;
+}
+
+Shape *Shape::addField(StringObject *name)
+{
+    for (auto &transition : transitions)
+    {
+        if (transition->names.back() == name)
+            return transition.get();
+    }
+
+    auto shape = std::make_unique<Shape>();
+    shape->names = names;
+    shape->names.push_back(move(name));
+    transitions.push_back(move(shape));
+    return transitions.back().get();
+}
+
+// Bytes owned by the shape and the subtree of its transitions.
+// Shape trees are as deep as an instance has fields, they are walked and
+// freed without recursion.
+std::size_t Shape::heapSize() const
+{
+    std::size_t size = 0;
+    std::vector<const Shape *> pending{this};
+    while (!pending.empty())
+    {
+        auto shape = pending.back();
+        pending.pop_back();
+        size += shape->names.capacity() * sizeof(StringObject *);
+        size += shape->transitions.capacity() * sizeof(std::unique_ptr<Shape>);
+        for (auto &transition : shape->transitions)
+        {
+            size += sizeof(Shape);
+            pending.push_back(transition.get());
+        }
+    }
+    return size;
+}
+
+Shape::~Shape()
+{
+    auto pending = std::move(transitions);
+    while (!pending.empty())
+    {
+        auto shape = std::move(pending.back());
+        pending.pop_back();
+        for (auto &transition : shape->transitions)
+        {
+            pending.push_back(std::move(transition));
+        }
+        shape->transitions.clear();
     }
-    return hash;
 }
 
 bool operator==(const StringObject &lhs, const StringObject &rhs)
@@ -23,35 +174,40 @@ bool operator==(const StringObject &lhs, const StringObject &rhs)
     return lhs.str == rhs.str;
 }
 
-string strObject(shared_ptr<Object> obj)
+string strObject(Object *obj)
 {
     switch (obj->type)
     {
     case ObjectType::OBJECT_STRING:
     {
-        auto strObj = static_pointer_cast<StringObject>(obj);
-        return strObj->str;
+        auto strObj = static_cast<StringObject *>(obj);
+        if (!strObj->isRope())
+            return strObj->str;
+
+        string str;
+        appendString(str, strObj);
+        return str;
     }
     case ObjectType::OBJECT_NATIVE:
         return "<native>";
     case ObjectType::OBJECT_BOUND_METHOD:
     {
-        auto boundMethod = static_pointer_cast<BoundMethodObject>(obj);
+        auto boundMethod = static_cast<BoundMethodObject *>(obj);
         return "<bound " + boundMethod->method->function->name->str + ">";
     }
     case ObjectType::OBJECT_CLASS:
     {
-        auto klass = static_pointer_cast<ClassObject>(obj);
+        auto klass = static_cast<ClassObject *>(obj);
         return "<class " + strObject(klass->name) + ">";
     }
     case ObjectType::OBJECT_INSTANCE:
     {
-        auto instance = static_pointer_cast<InstanceObject>(obj);
+        auto instance = static_cast<InstanceObject *>(obj);
         return "<instance " + strObject(instance->klass->name) + ">";
     }
     case ObjectType::OBJECT_CLOSURE:
     {
-        auto closure = static_pointer_cast<ClosureObject>(obj);
+        auto closure = static_cast<ClosureObject *>(obj);
         auto fnName =
             closure->function->name
                 ? strObject(closure->function->name)
@@ -60,7 +216,7 @@ string strObject(shared_ptr<Object> obj)
     }
     case ObjectType::OBJECT_FUNCTION:
     {
-        auto funcObj = static_pointer_cast<FunctionObject>(obj);
+        auto funcObj = static_cast<FunctionObject *>(obj);
         return funcObj->name ? "<fn " + funcObj->name->str + ">" : "<script>";
     }
     default:
@@ -68,8 +224,98 @@ string strObject(shared_ptr<Object> obj)
     }
 }
 
+// Appends the characters of a string, walking ropes without recursion as
+// strings built in a loop make them deep.
+void appendString(string &out, const StringObject *object)
+{
+    std::vector<const StringObject *> pending{object};
+    while (!pending.empty())
+    {
+        auto node = pending.back();
+        pending.pop_back();
+        if (node->isRope())
+        {
+            pending.push_back(node->right);
+            pending.push_back(node->left);
+        }
+        else
+            out += node->str;
+    }
+}
+
+// Size of the object including the memory owned by its containers. The Gc
+// adds it when the object is tracked and subtracts it when the object is
+// freed, containers that grow in between have to report the difference.
+std::size_t objectSize(const Object *obj)
+{
+    switch (obj->type)
+    {
+    case ObjectType::OBJECT_BOUND_METHOD:
+        return sizeof(BoundMethodObject);
+    case ObjectType::OBJECT_CLASS:
+    {
+        auto klass = static_cast<const ClassObject *>(obj);
+        return sizeof(ClassObject) + klass->methods.heapSize() + klass->rootShape.heapSize();
+    }
+    case ObjectType::OBJECT_CLOSURE:
+    {
+        auto closure = static_cast<const ClosureObject *>(obj);
+        return sizeof(ClosureObject) + closure->upvalues.capacity() * sizeof(UpvalueObject *);
+    }
+    case ObjectType::OBJECT_FUNCTION:
+        return sizeof(FunctionObject) + static_cast<const FunctionObject *>(obj)->chunk.heapSize();
+    case ObjectType::OBJECT_INSTANCE:
+        return sizeof(InstanceObject) + static_cast<const InstanceObject *>(obj)->fields.capacity() * sizeof(Value);
+    case ObjectType::OBJECT_NATIVE:
+        return sizeof(NativeObject);
+    case ObjectType::OBJECT_STRING:
+    {
+        // Short strings live inside the std::string itself.
+        static const auto inlineCapacity = std::string{}.capacity();
+        auto &str = static_cast<const StringObject *>(obj)->str;
+        return sizeof(StringObject) + (str.capacity() > inlineCapacity ? str.capacity() + 1 : 0);
+    }
+    case ObjectType::OBJECT_UPVALUE:
+        return sizeof(UpvalueObject);
+    }
+    return sizeof(Object);
+}
+
+// Object has no virtual destructor to keep the header small, so the concrete
+// type is recovered from the type tag.
+void freeObject(Object *obj)
+{
+    switch (obj->type)
+    {
+    case ObjectType::OBJECT_BOUND_METHOD:
+        delete static_cast<BoundMethodObject *>(obj);
+        break;
+    case ObjectType::OBJECT_CLASS:
+        delete static_cast<ClassObject *>(obj);
+        break;
+    case ObjectType::OBJECT_CLOSURE:
+        delete static_cast<ClosureObject *>(obj);
+        break;
+    case ObjectType::OBJECT_FUNCTION:
+        delete static_cast<FunctionObject *>(obj);
+        break;
+    case ObjectType::OBJECT_INSTANCE:
+        delete static_cast<InstanceObject *>(obj);
+        break;
+    case ObjectType::OBJECT_NATIVE:
+        delete static_cast<NativeObject *>(obj);
+        break;
+    case ObjectType::OBJECT_STRING:
+        delete static_cast<StringObject *>(obj);
+        break;
+    case ObjectType::OBJECT_UPVALUE:
+        delete static_cast<UpvalueObject *>(obj);
+        break;
+    }
+}
+
 void printObject(const Value &value)
 {
-    assert(value.type == ValueType::VAL_OBJ);
+    assert(isObject(value));
     std::cout << strObject(asObject(value));
 }
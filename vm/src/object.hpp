@@ -1,6 +1,7 @@
 #ifndef _OBJECT_HPP_
 #define _OBJECT_HPP_
 #include <string>
+#include <string_view>
 #include <memory>
 #include <vector>
 #include <cassert>
@@ -9,8 +10,9 @@
 #include "chunk.hpp"
 #include "common.hpp"
 #include "table.hpp"
+#include "arena.hpp"
 
-std::uint32_t hashString(const std::string &);
+std::uint32_t hashString(std::string_view);
 
 enum class ObjectType
 {
@@ -26,25 +28,63 @@ enum class ObjectType
 
 using NativeFn = Value (*)(int argCount, Value *args);
 
+// Objects are owned by the Vm's intrusive list through next and freed by the
+// Gc, references between them are plain pointers.
 struct Object
 {
     ObjectType type;
     bool isMarked = false;
-    virtual ~Object() = default;
-    std::shared_ptr<Object> next{};
+    bool isOld = false;
+    bool isRemembered = false;
+    // Tracked by the heap profiler until it is freed.
+    bool isSampled = false;
+    Object *next = nullptr;
+
+    static void *operator new(std::size_t size) { return Arena::current->allocate(size); }
+    static void operator delete(void *pointer, std::size_t size) { Arena::current->free(pointer, size); }
 
 protected:
     Object(ObjectType type) : type{std::move(type)} {}
 };
 
+// Concatenations of at least ROPE_MIN_LENGTH characters are ropes, shorter
+// ones are copied.
+#define ROPE_MIN_LENGTH 64
+
 struct StringObject : public Object
 {
     explicit StringObject() : Object{ObjectType::OBJECT_STRING}, str{}, hash{} {}
+    explicit StringObject(std::string str)
+        : str{std::move(str)}, Object{ObjectType::OBJECT_STRING}, hash{}, length{this->str.size()} {}
     explicit StringObject(std::string str, std::uint32_t hash)
-        : str{std::move(str)}, Object{ObjectType::OBJECT_STRING}, hash{hash} {}
+        : str{std::move(str)}, Object{ObjectType::OBJECT_STRING}, hash{hash}, hasHash{true}, length{this->str.size()} {}
+    explicit StringObject(StringObject *left, StringObject *right)
+        : Object{ObjectType::OBJECT_STRING}, hash{}, left{left}, right{right}, length{left->length + right->length} {}
+    bool isRope() const { return left; }
+
+    // Hashed on first use, most strings made at run time never are. Interned
+    // strings always have their hash.
+    std::uint32_t getHash()
+    {
+        if (!hasHash)
+        {
+            hash = hashString(str);
+            hasHash = true;
+        }
+        return hash;
+    }
 
     std::string str;
     std::uint32_t hash;
+    bool hasHash = false;
+    // Only interned strings can be compared by identity. Strings made at run
+    // time are interned once they are compared.
+    bool isInterned = false;
+    // A rope is the concatenation of left and right, its str stays empty
+    // until the Vm flattens it.
+    StringObject *left{};
+    StringObject *right{};
+    std::size_t length = 0;
 };
 
 struct UpvalueObject : public Object
@@ -54,6 +94,7 @@ struct UpvalueObject : public Object
 
     Value *location;
     Value closed{NilVal};
+    UpvalueObject *nextUpvalue{};
 };
 
 struct Upvalue
@@ -64,7 +105,7 @@ struct Upvalue
 
 struct FunctionObject : public Object
 {
-    explicit FunctionObject(int arity, std::shared_ptr<StringObject> name)
+    explicit FunctionObject(int arity, StringObject *name)
         : Object{ObjectType::OBJECT_FUNCTION}, arity{std::move(arity)}, chunk{}, name{std::move(name)} {}
 
     explicit FunctionObject()
@@ -72,55 +113,75 @@ struct FunctionObject : public Object
 
     int arity = 0;
     int upvalueCount = 0;
+    // Most values the function has on the stack at once, counting from its
+    // slot zero.
+    int stackSize = 0;
     Chunk chunk;
-    std::shared_ptr<StringObject> name{};
+    StringObject *name{};
 };
 
 struct ClosureObject : public Object
 {
-    // explicit ClosureObject(std::shared_ptr<FunctionObject> function)
-    //     : Object{ObjectType::OBJECT_CLOSURE}, function{std::move(function)}, upvalueCount{function->upvalueCount}, upvalues(new std::shared_ptr<UpvalueObject>[function->upvalueCount])
+    // explicit ClosureObject(FunctionObject *function)
+    //     : Object{ObjectType::OBJECT_CLOSURE}, function{std::move(function)}, upvalueCount{function->upvalueCount}, upvalues(new UpvalueObject *[function->upvalueCount])
     // {
     //     std::cout << "initialized closure object for upvalue count " << function->upvalueCount << std::endl;
     // }
 
-    explicit ClosureObject(std::shared_ptr<FunctionObject> function)
+    explicit ClosureObject(FunctionObject *function)
         : Object{ObjectType::OBJECT_CLOSURE}, function{function}, upvalueCount{function->upvalueCount}
     {
         upvalues.resize(function->upvalueCount);
     }
 
-    std::shared_ptr<FunctionObject> function;
-    // std::unique_ptr<std::shared_ptr<UpvalueObject>[]> upvalues;
-    std::vector<std::shared_ptr<UpvalueObject>> upvalues;
+    FunctionObject *function;
+    // std::unique_ptr<UpvalueObject *[]> upvalues;
+    std::vector<UpvalueObject *> upvalues;
     int upvalueCount;
 };
 
+// Maps field names to slots of InstanceObject::fields. Instances of a class
+// that got the same fields assigned in the same order share a Shape, the
+// shapes of a class form a transition tree with one edge per added field.
+struct Shape
+{
+    Shape() = default;
+    ~Shape();
+    int findSlot(const StringObject *) const;
+    Shape *addField(StringObject *);
+    std::size_t heapSize() const;
+
+    std::vector<StringObject *> names{};
+    std::vector<std::unique_ptr<Shape>> transitions{};
+};
+
 struct ClassObject : public Object
 {
-    explicit ClassObject(std::shared_ptr<StringObject> name)
+    explicit ClassObject(StringObject *name)
         : Object{ObjectType::OBJECT_CLASS}, name{std::move(name)} {}
 
-    std::shared_ptr<StringObject> name{};
+    StringObject *name{};
     Table methods;
+    Shape rootShape{};
 };
 
 struct InstanceObject : public Object
 {
-    explicit InstanceObject(std::shared_ptr<ClassObject> klass)
-        : Object{ObjectType::OBJECT_INSTANCE}, klass{std::move(klass)} {}
+    explicit InstanceObject(ClassObject *klass)
+        : Object{ObjectType::OBJECT_INSTANCE}, klass{std::move(klass)}, shape{&this->klass->rootShape} {}
 
-    std::shared_ptr<ClassObject> klass{};
-    Table fields;
+    ClassObject *klass{};
+    Shape *shape;
+    std::vector<Value> fields{};
 };
 
 struct BoundMethodObject : public Object
 {
-    explicit BoundMethodObject(Value receiver, std::shared_ptr<ClosureObject> method)
+    explicit BoundMethodObject(Value receiver, ClosureObject *method)
         : Object{ObjectType::OBJECT_BOUND_METHOD}, receiver{receiver}, method{method} {}
 
     Value receiver;
-    std::shared_ptr<ClosureObject> method;
+    ClosureObject *method;
 };
 
 struct NativeObject : public Object
@@ -178,102 +239,109 @@ inline bool isNative(const Value value)
     return isObjectType(value, ObjectType::OBJECT_NATIVE);
 }
 
-inline std::shared_ptr<StringObject> asString(const Value value)
+inline StringObject *asString(const Value value)
 {
     auto obj = asObject(value);
     assert(obj->type == ObjectType::OBJECT_STRING);
-    return std::static_pointer_cast<StringObject>(std::move(obj));
+    return static_cast<StringObject *>(obj);
 }
 
-inline std::shared_ptr<FunctionObject> asFunction(const Value value)
+inline FunctionObject *asFunction(const Value value)
 {
     auto obj = asObject(value);
     assert(obj->type == ObjectType::OBJECT_FUNCTION);
-    return std::static_pointer_cast<FunctionObject>(std::move(obj));
+    return static_cast<FunctionObject *>(obj);
 }
 
-inline std::shared_ptr<ClosureObject> asClosure(const Value value)
+inline ClosureObject *asClosure(const Value value)
 {
     auto obj = asObject(value);
     assert(obj->type == ObjectType::OBJECT_CLOSURE);
-    return std::static_pointer_cast<ClosureObject>(std::move(obj));
+    return static_cast<ClosureObject *>(obj);
 }
 
-inline std::shared_ptr<ClassObject> asClass(const Value value)
+inline ClassObject *asClass(const Value value)
 {
     auto obj = asObject(value);
     assert(obj->type == ObjectType::OBJECT_CLASS);
-    return std::static_pointer_cast<ClassObject>(std::move(obj));
+    return static_cast<ClassObject *>(obj);
 }
 
-inline std::shared_ptr<InstanceObject> asInstance(const Value value)
+inline InstanceObject *asInstance(const Value value)
 {
     auto obj = asObject(value);
     assert(obj->type == ObjectType::OBJECT_INSTANCE);
-    return std::static_pointer_cast<InstanceObject>(std::move(obj));
+    return static_cast<InstanceObject *>(obj);
 }
 
-inline std::shared_ptr<BoundMethodObject> asBoundMethod(const Value value)
+inline BoundMethodObject *asBoundMethod(const Value value)
 {
     auto obj = asObject(value);
     assert(obj->type == ObjectType::OBJECT_BOUND_METHOD);
-    return std::static_pointer_cast<BoundMethodObject>(std::move(obj));
+    return static_cast<BoundMethodObject *>(obj);
 }
 
-inline std::shared_ptr<NativeObject> asNative(const Value value)
+inline NativeObject *asNative(const Value value)
 {
     auto obj = asObject(value);
     assert(obj->type == ObjectType::OBJECT_NATIVE);
-    return std::static_pointer_cast<NativeObject>(std::move(obj));
+    return static_cast<NativeObject *>(obj);
+}
+
+inline StringObject *newString(std::string str)
+{
+    return new StringObject(std::move(str));
 }
 
-inline std::shared_ptr<StringObject> newString(std::string str)
+// For strings whose hash was computed to look them up.
+inline StringObject *newHashedString(std::string str, std::uint32_t hash)
 {
-    auto hash = hashString(str);
-    return std::make_shared<StringObject>(std::move(str), std::move(hash));
+    return new StringObject(std::move(str), hash);
 }
 
-inline std::shared_ptr<UpvalueObject> newUpvalue(Value *slot)
+inline StringObject *newRope(StringObject *left, StringObject *right)
 {
-    return std::make_shared<UpvalueObject>(slot);
+    return new StringObject(left, right);
 }
 
-inline std::shared_ptr<FunctionObject> newFunction()
+inline UpvalueObject *newUpvalue(Value *slot)
 {
-    return std::make_shared<FunctionObject>();
+    return new UpvalueObject(slot);
 }
 
-inline std::shared_ptr<ClosureObject> newClosure(std::shared_ptr<FunctionObject> function)
+inline FunctionObject *newFunction()
 {
-    return std::make_shared<ClosureObject>(std::move(function));
+    return new FunctionObject();
 }
 
-inline std::shared_ptr<ClassObject> newClass(std::shared_ptr<StringObject> name)
+inline ClosureObject *newClosure(FunctionObject *function)
 {
-    return std::make_shared<ClassObject>(std::move(name));
+    return new ClosureObject(std::move(function));
 }
 
-inline std::shared_ptr<InstanceObject> newInstance(std::shared_ptr<ClassObject> klass)
+inline ClassObject *newClass(StringObject *name)
 {
-    return std::make_shared<InstanceObject>(std::move(klass));
+    return new ClassObject(std::move(name));
 }
 
-inline std::shared_ptr<BoundMethodObject> newBoundMethod(Value value, std::shared_ptr<ClosureObject> method)
+inline InstanceObject *newInstance(ClassObject *klass)
 {
-    return std::make_shared<BoundMethodObject>(std::move(value), std::move(method));
+    return new InstanceObject(std::move(klass));
 }
 
-inline std::shared_ptr<NativeObject> newNative(NativeFn fn)
+inline BoundMethodObject *newBoundMethod(Value value, ClosureObject *method)
 {
-    return std::make_shared<NativeObject>(std::move(fn));
+    return new BoundMethodObject(std::move(value), std::move(method));
 }
 
-inline std::shared_ptr<Value> newVal()
+inline NativeObject *newNative(NativeFn fn)
 {
-    auto val = new Value{ValueType::VAL_BOOL, false};
-    return std::shared_ptr<Value>{val};
+    return new NativeObject(std::move(fn));
 }
 
-std::string strObject(std::shared_ptr<Object>);
+std::string strObject(Object *);
+void appendString(std::string &, const StringObject *);
+std::size_t objectSize(const Object *);
+void freeObject(Object *);
 void printObject(const Value &value);
 #endif
\ No newline at end of file
@@ -0,0 +1,86 @@
+#include <algorithm>
+#include "pacer.hpp"
+
+using std::size_t;
+using std::chrono::duration;
+using std::chrono::steady_clock;
+
+// Heaps below the floor are never collected, so small scripts run without
+// a single collection.
+#define GC_HEAP_FLOOR (4 * 1024 * 1024)
+#define GC_FIRST_MAJOR (8 * 1024 * 1024)
+#define GC_NURSERY_SIZE (256 * 1024)
+#define GC_MIN_NURSERY (64 * 1024)
+#define GC_MAX_NURSERY (16 * 1024 * 1024)
+// Bounds of the headroom given to the next major cycle, relative to the
+// live bytes.
+#define GC_MIN_HEADROOM 0.25
+#define GC_MAX_HEADROOM 3.0
+#define GC_SMOOTHING 0.5
+
+inline double smooth(double average, double sample)
+{
+    return average ? average + GC_SMOOTHING * (sample - average) : sample;
+}
+
+Pacer::Pacer(size_t maxHeapBytes, double cpuTarget, int pauseGoalMicros)
+    : maxHeapBytes{maxHeapBytes}, cpuTarget{cpuTarget}, pauseGoalMicros{pauseGoalMicros},
+      nursery{GC_NURSERY_SIZE}, cycleStart{steady_clock::now()}
+{
+}
+
+size_t Pacer::heapFloor() const
+{
+    return maxHeapBytes ? std::min<size_t>(GC_HEAP_FLOOR, maxHeapBytes / 2) : GC_HEAP_FLOOR;
+}
+
+size_t Pacer::firstMajorThreshold() const
+{
+    return maxHeapBytes ? std::min<size_t>(GC_FIRST_MAJOR, maxHeapBytes) : GC_FIRST_MAJOR;
+}
+
+void Pacer::minorCollected(double pauseMicros, size_t youngBytes, size_t survivedBytes)
+{
+    minorMicros += pauseMicros;
+    if (!pauseGoalMicros || !youngBytes)
+        return;
+
+    nurserySurvival = smooth(nurserySurvival, static_cast<double>(survivedBytes) / youngBytes);
+    minorCost = smooth(minorCost, pauseMicros / std::max<size_t>(survivedBytes, 1));
+
+    auto perNurseryByte = minorCost * nurserySurvival;
+    auto size = perNurseryByte > 0 ? pauseGoalMicros / perNurseryByte : GC_MAX_NURSERY;
+    nursery = std::clamp<size_t>(size, GC_MIN_NURSERY, GC_MAX_NURSERY);
+}
+
+void Pacer::majorWork(double pauseMicros)
+{
+    majorMicros += pauseMicros;
+}
+
+// Called once a major collection is swept, returns the heap size that
+// starts the next one.
+size_t Pacer::majorFinished(size_t liveBytes, size_t totalAllocated)
+{
+    auto now = steady_clock::now();
+    auto wall = duration<double, std::micro>(now - cycleStart).count();
+    auto mutatorMicros = std::max(wall - minorMicros - majorMicros, 1.0);
+    allocRate = smooth(allocRate, (totalAllocated - cycleAllocated) / mutatorMicros);
+    markCost = smooth(markCost, majorMicros / std::max<size_t>(liveBytes, 1));
+
+    // The collector's share is cost / (cost + headroom / allocRate).
+    auto cost = markCost * liveBytes;
+    auto headroom = allocRate * cost * (1 - cpuTarget) / cpuTarget;
+    headroom = std::clamp(headroom, std::max(liveBytes * GC_MIN_HEADROOM, static_cast<double>(nursery)),
+                          std::max(liveBytes * GC_MAX_HEADROOM, static_cast<double>(nursery)));
+
+    auto threshold = std::max<size_t>(liveBytes + headroom, heapFloor());
+    if (maxHeapBytes)
+        threshold = std::max(std::min(threshold, maxHeapBytes), liveBytes + nursery);
+
+    cycleStart = now;
+    cycleAllocated = totalAllocated;
+    minorMicros = 0;
+    majorMicros = 0;
+    return threshold;
+}
@@ -0,0 +1,38 @@
+#ifndef _PACER_HPP_
+#define _PACER_HPP_
+#include <chrono>
+#include <cstddef>
+
+// Picks the collector's thresholds from what it measured: the next major
+// collection gets the headroom that keeps the collector's share of the run
+// time at the CPU target, given the allocation rate and the cost of tracing
+// the surviving bytes. With a pause goal the nursery is sized so minor
+// collections, whose cost grows with the bytes that survive them, meet it.
+class Pacer
+{
+public:
+    explicit Pacer(std::size_t maxHeapBytes, double cpuTarget, int pauseGoalMicros);
+    std::size_t heapFloor() const;
+    std::size_t firstMajorThreshold() const;
+    std::size_t nurserySize() const { return nursery; }
+    void minorCollected(double pauseMicros, std::size_t youngBytes, std::size_t survivedBytes);
+    void majorWork(double pauseMicros);
+    std::size_t majorFinished(std::size_t liveBytes, std::size_t totalAllocated);
+    double allocationRate() const { return allocRate; }
+
+private:
+    std::size_t maxHeapBytes;
+    double cpuTarget;
+    int pauseGoalMicros;
+    std::size_t nursery;
+    std::chrono::steady_clock::time_point cycleStart;
+    std::size_t cycleAllocated = 0;
+    double minorMicros = 0;
+    double majorMicros = 0;
+    // Moving averages, bytes per microsecond and microseconds per byte.
+    double allocRate = 0;
+    double markCost = 0;
+    double minorCost = 0;
+    double nurserySurvival = 0;
+};
+#endif
@@ -1,144 +1,277 @@
 #include <iostream>
+#include <algorithm>
 #include "object.hpp"
 #include "table.hpp"
 
-#define TABLE_MAX_LOAD 0.75
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
-using std::make_shared;
+// Rebuild once seven eighths of the slots are used.
+#define TABLE_MAX_LOAD_NUM 7
+#define TABLE_MAX_LOAD_DEN 8
+// Tables with fewer slots are rebuilt at once, larger ones move this many
+// slots of the old storage per operation.
+#define TABLE_INCREMENTAL_MIN 1024
+#define TABLE_MIGRATE_SLOTS 64
+
+#define CONTROL_EMPTY static_cast<std::int8_t>(-128)
+#define CONTROL_DELETED static_cast<std::int8_t>(-2)
+
+using std::int64_t;
+using std::int8_t;
 using std::move;
 using std::nullopt;
 using std::optional;
-using std::shared_ptr;
-using std::uint8_t;
+using std::uint32_t;
 using std::vector;
 
-inline int growCapacity(int capacity)
+// The low 7 bits of the hash go into the control byte, the rest picks the
+// group to start probing at.
+inline int8_t hashFragment(uint32_t hash)
 {
-    return capacity <= 0 ? 8 : 2 * capacity;
+    return static_cast<int8_t>(hash & 0x7f);
 }
 
-Table::Table()
+inline uint32_t hashGroup(uint32_t hash)
+{
+    return hash >> 7;
+}
+
+// Bit i of the result is set when byte i of the group equals value.
+inline uint32_t matchByte(const int8_t *group, int8_t value)
+{
+#ifdef __SSE2__
+    auto bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(group));
+    return static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(value))));
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < TABLE_GROUP_WIDTH; i++)
+    {
+        if (group[i] == value)
+            mask |= 1u << i;
+    }
+    return mask;
+#endif
+}
+
+// Empty and deleted control bytes are the only negative ones.
+inline uint32_t matchFree(const int8_t *group)
+{
+#ifdef __SSE2__
+    auto bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(group));
+    return static_cast<uint32_t>(_mm_movemask_epi8(bytes));
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < TABLE_GROUP_WIDTH; i++)
+    {
+        if (group[i] < 0)
+            mask |= 1u << i;
+    }
+    return mask;
+#endif
+}
+
+inline auto sameKey(const StringObject *key)
 {
-    entries.resize(0);
+    return [key](const StringObject *candidate)
+    { return candidate == key; };
 }
 
-bool Table::set(shared_ptr<StringObject> key, Value value)
+// Returns the slot holding the key that matches, -1 when there is none.
+// Groups are probed in triangular order, which visits each of them once
+// since their number is a power of two.
+template <typename Matches>
+int64_t TableStorage::findSlot(uint32_t hash, Matches matches) const
 {
-    checkAndAdjustCapacity();
-    auto index = findEntryIndex(key);
-    auto &entry = entries[index];
-    auto isNew = !entry.key && isNil(entry.value);
-    if (isNew)
-        count++;
+    if (control.empty())
+        return -1;
 
-    entry.key = move(key);
-    entry.value = move(value);
-    return isNew;
+    auto groupMask = control.size() / TABLE_GROUP_WIDTH - 1;
+    auto group = hashGroup(hash) & groupMask;
+    auto fragment = hashFragment(hash);
+    for (uint32_t step = 1;; step++)
+    {
+        auto base = group * TABLE_GROUP_WIDTH;
+        auto groupControl = &control[base];
+        for (auto mask = matchByte(groupControl, fragment); mask; mask &= mask - 1)
+        {
+            auto slot = base + __builtin_ctz(mask);
+            if (matches(entries[slots[slot]].key))
+                return slot;
+        }
+        if (matchByte(groupControl, CONTROL_EMPTY) || step > groupMask)
+            return -1;
+
+        group = (group + step) & groupMask;
+    }
 }
 
-optional<Value> Table::get(shared_ptr<StringObject> &key) const
+// The first empty or deleted slot on the probe sequence of hash.
+uint32_t TableStorage::findFreeSlot(uint32_t hash) const
 {
-    if (!count)
-        return nullopt;
+    auto groupMask = control.size() / TABLE_GROUP_WIDTH - 1;
+    auto group = hashGroup(hash) & groupMask;
+    for (uint32_t step = 1;; step++)
+    {
+        auto base = group * TABLE_GROUP_WIDTH;
+        auto mask = matchFree(&control[base]);
+        if (mask)
+            return base + __builtin_ctz(mask);
 
-    const auto &entry = entries[findEntryIndex(key)];
-    if (!entry.key)
-        return nullopt;
+        group = (group + step) & groupMask;
+    }
+}
 
-    return entry.value;
+// Adds a key that is not in the storage yet, there must be room for it.
+void TableStorage::insert(StringObject *key, Value value)
+{
+    auto hash = key->getHash();
+    auto free = findFreeSlot(hash);
+    control[free] = hashFragment(hash);
+    slots[free] = entries.size();
+    entries.emplace_back(key, move(value));
 }
 
-bool Table::deleteKey(shared_ptr<StringObject> &key)
+// The slot stays used so probe sequences running through it go on.
+void TableStorage::removeSlot(uint32_t slot)
 {
-    if (!count)
-        return false;
+    auto &entry = entries[slots[slot]];
+    entry.key = nullptr;
+    entry.value = NilVal;
+    control[slot] = CONTROL_DELETED;
+}
 
-    auto index = findEntryIndex(key);
-    auto &entry = entries[index];
-    if (!entry.key)
-        return false;
+// Every entry, removed ones included, took a slot once, so this also
+// bounds the slots that are not empty.
+bool TableStorage::isFull() const
+{
+    return (entries.size() + 1) * TABLE_MAX_LOAD_DEN > control.size() * TABLE_MAX_LOAD_NUM;
+}
 
-    entries[index].key = shared_ptr<StringObject>();
-    entries[index].value = FalseVal;
-    return true;
+std::size_t TableStorage::heapSize() const
+{
+    return control.capacity() * (sizeof(int8_t) + sizeof(uint32_t)) +
+           entries.capacity() * sizeof(Entry);
 }
 
-optional<shared_ptr<StringObject>> Table::findKey(const std::string &alias, uint32_t hash)
+Table::Table()
 {
-    if (!count)
-        return nullopt;
+}
 
-    uint8_t index = hash & (entries.size() - 1);
-    for (;;)
+bool Table::set(StringObject *key, Value value)
+{
+    auto entry = findEntry(key);
+    if (entry)
     {
-        const auto &entry = entries[index];
-        if (!entry.key)
-        {
-            if (isNil(entry.value))
-            {
-                return nullopt;
-            }
-        }
-        else
-        {
-            if (entry.key->hash == hash && entry.key->str == alias)
-                return entry.key;
-        }
+        entry.value()->value = move(value);
+        return false;
+    }
+
+    if (storage.isFull())
+        startRebuild();
+    storage.insert(key, move(value));
+    count++;
+    return true;
+}
 
-        index = (index + 1) & (entries.size() - 1);
+optional<Value> Table::get(StringObject *key) const
+{
+    auto hash = key->getHash();
+    for (auto table : {&storage, &old})
+    {
+        auto slot = table->findSlot(hash, sameKey(key));
+        if (slot >= 0)
+            return table->entries[table->slots[slot]].value;
     }
+    return nullopt;
 }
 
-int Table::findEntryIndex(shared_ptr<StringObject> &key) const
+bool Table::deleteKey(StringObject *key)
 {
-    auto tombstoneIndex = -1;
-    uint8_t index = key->hash & (entries.size() - 1);
-    for (;;)
+    migrate(TABLE_MIGRATE_SLOTS);
+    auto hash = key->getHash();
+    for (auto table : {&storage, &old})
     {
-        const auto &entry = entries[index];
-        if (!entry.key)
+        auto slot = table->findSlot(hash, sameKey(key));
+        if (slot >= 0)
         {
-            if (isNil(entry.value))
-            {
-                return tombstoneIndex < 0 ? index : tombstoneIndex;
-            }
-            else
-            {
-                if (tombstoneIndex < 0)
-                    tombstoneIndex = index;
-            }
+            table->removeSlot(slot);
+            count--;
+            return true;
         }
-        else if (entry.key == key)
-            return index;
+    }
+    return false;
+}
 
-        index = (index + 1) & (entries.size() - 1);
+optional<StringObject *> Table::findKey(std::string_view alias, uint32_t hash)
+{
+    migrate(TABLE_MIGRATE_SLOTS);
+    auto sameString = [&](const StringObject *candidate)
+    { return candidate->hash == hash && candidate->str == alias; };
+    for (auto table : {&storage, &old})
+    {
+        auto slot = table->findSlot(hash, sameString);
+        if (slot >= 0)
+            return table->entries[table->slots[slot]].key;
     }
+    return nullopt;
 }
 
-void Table::checkAndAdjustCapacity()
+// Finds the entry of key for an update, moving part of a rebuild on.
+optional<Entry *> Table::findEntry(StringObject *key)
 {
-    if (count + 1 > entries.size() * TABLE_MAX_LOAD)
+    migrate(TABLE_MIGRATE_SLOTS);
+    auto hash = key->getHash();
+    for (auto table : {&storage, &old})
     {
-        int newCapacity = growCapacity(entries.size());
-        adjustCapacity(newCapacity);
+        auto slot = table->findSlot(hash, sameKey(key));
+        if (slot >= 0)
+            return &table->entries[table->slots[slot]];
     }
+    return nullopt;
+}
+
+// Starts moving the entries into a new storage, twice as large unless most
+// entries were removed. The new storage holds the live entries at half its
+// load, a rebuild finishes long before it fills up.
+void Table::startRebuild()
+{
+    // The previous rebuild has to finish first.
+    migrate(UINT32_MAX);
+
+    auto capacity = std::max<std::size_t>(storage.control.size(), TABLE_GROUP_WIDTH);
+    while ((count + 1) * 2 * TABLE_MAX_LOAD_DEN > capacity * TABLE_MAX_LOAD_NUM)
+        capacity *= 2;
+
+    old = move(storage);
+    storage = TableStorage{};
+    storage.control.assign(capacity, CONTROL_EMPTY);
+    storage.slots.reset(new uint32_t[capacity]);
+    storage.entries.reserve(capacity * TABLE_MAX_LOAD_NUM / TABLE_MAX_LOAD_DEN);
+    migrated = 0;
+    if (capacity < TABLE_INCREMENTAL_MIN)
+        migrate(UINT32_MAX);
 }
 
-void Table::adjustCapacity(int newCapacity)
+// Moves the live entries of up to limit slots of the old storage.
+void Table::migrate(uint32_t limit)
 {
-    auto oldSize = entries.size();
-    entries.resize(newCapacity);
+    if (!isRebuilding())
+        return;
 
-    // Re-index old entries.
-    for (int i = 0; i < oldSize; i++)
+    auto end = std::min<std::size_t>(old.control.size(), static_cast<std::size_t>(migrated) + limit);
+    for (; migrated < end; migrated++)
     {
-        if (entries[i].key)
-        {
-            auto entry = entries[i];
-            entries[i] = Entry{};
-            entries[findEntryIndex(entry.key)] = move(entry);
-        }
+        if (old.control[migrated] < 0)
+            continue;
+
+        auto &entry = old.entries[old.slots[migrated]];
+        storage.insert(entry.key, entry.value);
+        old.removeSlot(migrated);
     }
+    if (migrated == old.control.size())
+        old = TableStorage{};
 }
 
 int Table::size() const
@@ -146,11 +279,19 @@ int Table::size() const
     return count;
 }
 
+std::size_t Table::heapSize() const
+{
+    return storage.heapSize() + old.heapSize();
+}
+
 void Table::addAll(const Table &other)
 {
-    for (const auto &entry : other.entries)
+    for (auto table : {&other.storage, &other.old})
     {
-        if (entry.key)
-            set(entry.key, entry.value);
+        for (const auto &entry : table->entries)
+        {
+            if (entry.key)
+                set(entry.key, entry.value);
+        }
     }
-}
\ No newline at end of file
+}
@@ -2,7 +2,9 @@
 #define _TABLE_HPP_
 #include <vector>
 #include <memory>
+#include <cstdint>
 #include <optional>
+#include <string_view>
 #include "value.hpp"
 
 class StringObject;
@@ -11,29 +13,99 @@ class Gc;
 struct Entry
 {
     explicit Entry() = default;
-    explicit Entry(std::shared_ptr<StringObject> key, Value value)
+    explicit Entry(StringObject *key, Value value)
         : key{std::move(key)}, value{std::move(value)} {}
-    std::shared_ptr<StringObject> key{};
+    StringObject *key{};
     Value value{NilVal};
 };
 
+// Slots are probed a group of TABLE_GROUP_WIDTH control bytes at a time.
+#define TABLE_GROUP_WIDTH 16
+
+// The slots and entries of a Table. Every slot has a control byte holding 7
+// bits of the key's hash, or marking it empty or deleted, so a probe compares
+// a whole group of slots with a few instructions and only looks at keys whose
+// bits match. Slots hold the index of their entry, entries are stored densely.
+struct TableStorage
+{
+    template <typename Matches>
+    std::int64_t findSlot(std::uint32_t, Matches) const;
+    std::uint32_t findFreeSlot(std::uint32_t) const;
+    void insert(StringObject *, Value);
+    void removeSlot(std::uint32_t);
+    bool isFull() const;
+    std::size_t heapSize() const;
+
+    std::vector<std::int8_t> control;
+    // Only read where the control byte marks a full slot, it is left
+    // uninitialized so large tables do not fault in all of it at once.
+    std::unique_ptr<std::uint32_t[]> slots;
+    // Removed entries have no key.
+    std::vector<Entry> entries;
+};
+
+// Hash table from interned strings to values in the style of Swiss tables.
+// Growing a large table does not rehash it at once: the entries move to the
+// new storage a few slots per operation while lookups check both. Rebuilding
+// drops removed entries, tables with many deletions are rebuilt at the same
+// capacity.
 class Table
 {
 public:
     explicit Table();
-    bool set(std::shared_ptr<StringObject>, Value);
-    std::optional<Value> get(std::shared_ptr<StringObject> &) const;
-    bool deleteKey(std::shared_ptr<StringObject> &);
-    std::optional<std::shared_ptr<StringObject>> findKey(const std::string &, std::uint32_t);
+    bool set(StringObject *, Value);
+    std::optional<Value> get(StringObject *) const;
+    bool deleteKey(StringObject *);
+    std::optional<StringObject *> findKey(std::string_view, std::uint32_t);
     int size() const;
+    std::size_t heapSize() const;
     void addAll(const Table &);
+    template <typename Predicate>
+    void removeIf(Predicate);
+    template <typename Visitor>
+    void forEach(Visitor) const;
 
 private:
     friend Gc;
-    int findEntryIndex(std::shared_ptr<StringObject> &) const;
-    void checkAndAdjustCapacity();
-    void adjustCapacity(int);
-    int count = 0;
-    std::vector<Entry> entries;
+    std::optional<Entry *> findEntry(StringObject *);
+    void startRebuild();
+    void migrate(std::uint32_t);
+    bool isRebuilding() const { return !old.control.empty(); }
+    std::uint32_t count = 0;
+    TableStorage storage;
+    // The storage being moved into storage, and the next slot of it to move.
+    TableStorage old;
+    std::uint32_t migrated = 0;
 };
-#endif
\ No newline at end of file
+
+// Deletes the entries whose key the predicate accepts.
+template <typename Predicate>
+void Table::removeIf(Predicate predicate)
+{
+    for (auto table : {&storage, &old})
+    {
+        for (std::uint32_t slot = 0; slot < table->control.size(); slot++)
+        {
+            if (table->control[slot] >= 0 && predicate(table->entries[table->slots[slot]].key))
+            {
+                table->removeSlot(slot);
+                count--;
+            }
+        }
+    }
+}
+
+// Calls visit with the key and value of every entry.
+template <typename Visitor>
+void Table::forEach(Visitor visit) const
+{
+    for (auto table : {&storage, &old})
+    {
+        for (auto &entry : table->entries)
+        {
+            if (entry.key)
+                visit(entry.key, entry.value);
+        }
+    }
+}
+#endif
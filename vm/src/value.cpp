@@ -6,12 +6,11 @@
 #include "object.hpp"
 
 using std::move;
-using std::shared_ptr;
 using std::string;
 
 void printValue(const Value &value)
 {
-    switch (value.type)
+    switch (valueType(value))
     {
     case ValueType::VAL_BOOL:
     {
@@ -33,7 +32,7 @@ void printValue(const Value &value)
 
 string strValue(const Value &value)
 {
-    switch (value.type)
+    switch (valueType(value))
     {
     case ValueType::VAL_BOOL:
         return asBool(value) ? "true" : "else";
@@ -45,4 +44,4 @@ string strValue(const Value &value)
         auto obj = asObject(value);
         return strObject(obj);
     }
-}
\ No newline at end of file
+}
@@ -1,7 +1,9 @@
 #ifndef _VALUE_HPP_
 #define _VALUE_HPP_
 #include <variant>
-#include <memory>
+#include <string>
+#include <cstdint>
+#include <bit>
 enum class ValueType
 {
     VAL_BOOL,
@@ -12,10 +14,93 @@ enum class ValueType
 
 class Object;
 
+#ifdef NAN_BOXING
+// Numbers are stored as plain doubles, everything else lives in the unused
+// bits of a quiet NaN. Object pointers set the sign bit, singletons use the
+// low tag bits.
+#define SIGN_BIT (static_cast<std::uint64_t>(0x8000000000000000))
+#define QNAN (static_cast<std::uint64_t>(0x7ffc000000000000))
+#define TAG_NIL 1
+#define TAG_FALSE 2
+#define TAG_TRUE 3
+
+struct Value
+{
+    std::uint64_t bits;
+};
+
+void printValue(const Value &);
+std::string strValue(const Value &);
+
+inline bool isBool(const Value value)
+{
+    return (value.bits | 1) == (QNAN | TAG_TRUE);
+}
+
+inline bool isNumber(const Value value)
+{
+    return (value.bits & QNAN) != QNAN;
+}
+
+inline bool isNil(const Value value)
+{
+    return value.bits == (QNAN | TAG_NIL);
+}
+
+inline bool isObject(const Value &value)
+{
+    return (value.bits & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT);
+}
+
+inline Value boolValue(bool b)
+{
+    return Value{QNAN | (b ? TAG_TRUE : TAG_FALSE)};
+}
+
+inline Value numberValue(double num)
+{
+    return Value{std::bit_cast<std::uint64_t>(num)};
+}
+
+inline Value objectValue(Object *obj)
+{
+    return Value{SIGN_BIT | QNAN | reinterpret_cast<std::uintptr_t>(obj)};
+}
+
+inline bool asBool(const Value value)
+{
+    return value.bits == (QNAN | TAG_TRUE);
+}
+
+inline double asNumber(const Value value)
+{
+    return std::bit_cast<double>(value.bits);
+}
+
+inline Object *asObject(const Value value)
+{
+    return reinterpret_cast<Object *>(value.bits & ~(SIGN_BIT | QNAN));
+}
+
+inline ValueType valueType(const Value value)
+{
+    if (isNumber(value))
+        return ValueType::VAL_NUMBER;
+    if (isObject(value))
+        return ValueType::VAL_OBJ;
+    if (isNil(value))
+        return ValueType::VAL_NIL;
+    return ValueType::VAL_BOOL;
+}
+
+const Value TrueVal = {QNAN | TAG_TRUE};
+const Value FalseVal = {QNAN | TAG_FALSE};
+const Value NilVal = {QNAN | TAG_NIL};
+#else
 struct Value
 {
     ValueType type;
-    std::variant<bool, double, std::shared_ptr<Object>> as;
+    std::variant<bool, double, Object *> as;
 };
 
 void printValue(const Value &);
@@ -31,9 +116,9 @@ inline Value numberValue(double num)
     return Value{ValueType::VAL_NUMBER, std::move(num)};
 }
 
-inline Value objectValue(std::shared_ptr<Object> obj)
+inline Value objectValue(Object *obj)
 {
-    return Value{ValueType::VAL_OBJ, std::move(obj)};
+    return Value{ValueType::VAL_OBJ, obj};
 }
 
 inline bool asBool(const Value value)
@@ -46,9 +131,9 @@ inline double asNumber(const Value value)
     return std::get<double>(value.as);
 }
 
-inline std::shared_ptr<Object> asObject(const Value &value)
+inline Object *asObject(const Value &value)
 {
-    return std::get<std::shared_ptr<Object>>(value.as);
+    return std::get<Object *>(value.as);
 }
 
 inline bool isBool(const Value value)
@@ -71,7 +156,13 @@ inline bool isObject(const Value &value)
     return value.type == ValueType::VAL_OBJ;
 }
 
+inline ValueType valueType(const Value &value)
+{
+    return value.type;
+}
+
 const Value TrueVal = {ValueType::VAL_BOOL, true};
 const Value FalseVal = {ValueType::VAL_BOOL, false};
 const Value NilVal = {ValueType::VAL_NIL, false};
-#endif
\ No newline at end of file
+#endif
+#endif
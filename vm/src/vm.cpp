@@ -1,7 +1,9 @@
+#include <algorithm>
 #include <exception>
 #include <iostream>
 #include <cstdarg>
 #include <utility>
+#include <unistd.h>
 #include "vm.hpp"
 #include "disassembler.hpp"
 #include "compiler.hpp"
@@ -10,32 +12,200 @@
 
 using std::move;
 using std::optional;
-using std::shared_ptr;
 using std::uint16_t;
+using std::uint32_t;
 using std::uint8_t;
 
-#define BINARY_OP(valueType, op)                             \
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(SWITCH_DISPATCH)
+#define COMPUTED_GOTO
+#endif
+
+// ip, slots and the constant table of the running frame are cached in locals
+// of Vm::run, they are synced with the CallFrame only around calls and returns.
+#define LOAD_FRAME()                                                        \
+    do                                                                      \
+    {                                                                       \
+        frame = &frames[frameCount - 1];                                    \
+        ip = frame->ip;                                                     \
+        slots = frame->slots;                                               \
+        constants = frame->closure->function->chunk.getConstantBaseAddr(); \
+        caches = frame->closure->function->chunk.getInlineCacheBaseAddr();  \
+    } while (false)
+
+#define STORE_FRAME() (frame->ip = ip)
+#define READ_BYTE() (*ip++)
+#define READ_SHORT() (ip += 2, static_cast<uint16_t>((ip[-2] << 8) | ip[-1]))
+#define READ_CONSTANT() (constants[READ_BYTE()])
+#define READ_STRING() asString(READ_CONSTANT())
+#define READ_INLINE_CACHE() (caches[READ_SHORT()])
+
+#ifdef DEBUG_TRACE_EXECUTION
+#define TRACE_INSTRUCTION() traceInstruction(frame, ip)
+#else
+#define TRACE_INSTRUCTION() ((void)0)
+#endif
+
+#ifdef COMPUTED_GOTO
+#define CASE(op)      \
+    case Opcode::op: \
+    label_##op
+#define DISPATCH()                        \
+    do                                    \
+    {                                     \
+        TRACE_INSTRUCTION();              \
+        goto *dispatchTable[READ_BYTE()]; \
+    } while (false)
+#else
+#define CASE(op) case Opcode::op
+#define DISPATCH() continue
+#endif
+
+#define RUNTIME_ERROR(...)                                   \
     do                                                       \
     {                                                        \
-        if (!isNumber(peek(0)) || !isNumber(peek(1)))        \
-        {                                                    \
-            runtimeError("Operands must be number.");        \
-            return InterpretResult::INTERPRET_RUNTIME_ERROR; \
-        }                                                    \
-        auto b = asNumber(pop());                            \
-        auto a = asNumber(pop());                            \
-        push(valueType(a op b));                             \
+        STORE_FRAME();                                       \
+        runtimeError(__VA_ARGS__);                           \
+        return InterpretResult::INTERPRET_RUNTIME_ERROR;     \
+    } while (false)
+
+// Rewrites the instruction being executed, ip already points past it.
+#define QUICKEN(op) (ip[-1] = static_cast<uint8_t>(Opcode::op))
+// Restores the generic instruction and rewinds ip so that it runs next.
+#define DEQUICKEN(op) (*--ip = static_cast<uint8_t>(Opcode::op))
+
+// An old object that is given a reference to a young one is remembered, minor
+// collections trace it as a root. While a major collection is marking, a
+// white object stored into a marked one is shaded gray. Globals and the stack
+// are always roots.
+#define WRITE_BARRIER(owner, value)                                     \
+    do                                                                  \
+    {                                                                   \
+        if (isObject(value))                                            \
+        {                                                               \
+            auto child = asObject(value);                               \
+            if ((owner)->isOld && !child->isOld)                        \
+                gc.remember(owner);                                     \
+            if (gc.isMarking() && (owner)->isMarked && !child->isMarked) \
+                gc.shade(child);                                        \
+        }                                                               \
+    } while (false)
+
+#define BOTH_NUMBERS() (isNumber(stackTop[-1]) && isNumber(stackTop[-2]))
+#define BOTH_STRINGS() (isString(stackTop[-1]) && isString(stackTop[-2]))
+
+#define FAST_BINARY_OP(valueType, op)                                                \
+    do                                                                               \
+    {                                                                                \
+        stackTop[-2] = valueType(asNumber(stackTop[-2]) op asNumber(stackTop[-1])); \
+        stackTop--;                                                                  \
+    } while (false)
+
+#define ADD_VALUES()                                           \
+    do                                                         \
+    {                                                          \
+        if (BOTH_STRINGS())                                    \
+        {                                                      \
+            STORE_FRAME();                                     \
+            concatenate();                                     \
+        }                                                      \
+        else if (BOTH_NUMBERS())                               \
+            FAST_BINARY_OP(numberValue, +);                    \
+        else if (isString(peek(0)) || isString(peek(1)))       \
+        {                                                      \
+            STORE_FRAME();                                     \
+            stringifyOperand(stackTop[-1]);                    \
+            stringifyOperand(stackTop[-2]);                    \
+            concatenate();                                     \
+        }                                                      \
+        else                                                   \
+            RUNTIME_ERROR("Operands mismatch.");               \
+    } while (false)
+
+#define LOCALS_BINARY_OP(valueType, op)                   \
+    do                                                    \
+    {                                                     \
+        auto &a = slots[READ_BYTE()];                     \
+        auto &b = slots[READ_BYTE()];                     \
+        if (!isNumber(a) || !isNumber(b))                 \
+            RUNTIME_ERROR("Operands must be number.");    \
+        push(valueType(asNumber(a) op asNumber(b)));      \
+    } while (false)
+
+#define LOCAL_CONST_JUMP(op)                              \
+    do                                                    \
+    {                                                     \
+        auto &a = slots[READ_BYTE()];                     \
+        auto &b = READ_CONSTANT();                        \
+        auto offset = READ_SHORT();                       \
+        if (!isNumber(a) || !isNumber(b))                 \
+            RUNTIME_ERROR("Operands must be number.");    \
+        if (!(asNumber(a) op asNumber(b)))                \
+            ip += offset;                                 \
     } while (false)
 
-Vm::Vm() : stackTop{&stack[0]}, gc{this}
+#define BINARY_OP(valueType, op)                          \
+    do                                                    \
+    {                                                     \
+        if (!isNumber(peek(0)) || !isNumber(peek(1)))     \
+            RUNTIME_ERROR("Operands must be number.");    \
+        auto b = asNumber(pop());                         \
+        auto a = asNumber(pop());                         \
+        push(valueType(a op b));                          \
+    } while (false)
+
+Vm *Vm::current = nullptr;
+
+Vm::Vm() : Vm{GcOptions{}}
 {
+}
+
+Vm::Vm(GcOptions gcOptions) : stack(STACK_INITIAL), stackTop{stack.data()}, frames(FRAMES_INITIAL), gc{this, gcOptions}
+{
+    Arena::current = &arena;
+    current = this;
     defineNative("clock", clockNative);
+    defineNative("heapSnapshot", heapSnapshotNative);
     initString = makeString("init");
 }
 
+Vm::~Vm()
+{
+    gc.reportStats();
+    if (profiler)
+        profiler->write();
+    freeObjects();
+    Arena::current = nullptr;
+    current = nullptr;
+}
+
+void Vm::enableHeapProfile(std::string path, std::size_t sampleRate)
+{
+    profiler = std::make_unique<HeapProfiler>(move(path), sampleRate);
+}
+
+void Vm::setMaxFrames(int limit)
+{
+    maxFrames = limit;
+    if (static_cast<int>(frames.size()) > limit)
+        frames.resize(limit);
+}
+
+bool Vm::writeHeapSnapshot(const std::string &path)
+{
+    return HeapSnapshot{this}.write(path);
+}
+
+// Answers SIGUSR1, called where the heap is consistent: before an
+// allocation and on backward jumps.
+void Vm::writeRequestedSnapshot()
+{
+    heapSnapshotRequested = 0;
+    writeHeapSnapshot("vlox-" + std::to_string(getpid()) + "-" + std::to_string(++snapshotCount) + ".heapsnapshot");
+}
+
 InterpretResult Vm::interpret(std::string &source)
 {
-    shared_ptr<FunctionObject> funcObj;
+    FunctionObject *funcObj;
 
     {
         auto compiler = createCompiler();
@@ -56,14 +226,20 @@ InterpretResult Vm::interpret(std::string &source)
 
 Compiler Vm::createCompiler()
 {
-    TryFindInternedStringFunc tryFindInternedString = [this](std::string &key)
-    { return this->findString(key); };
+    TryFindInternedStringFunc tryFindInternedString = [this](std::string_view key, std::uint32_t hash)
+    { return this->findString(key, hash); };
 
-    AddStringToInternFunc addStringToIntern = [this](shared_ptr<StringObject> obj)
+    AddStringToInternFunc addStringToIntern = [this](StringObject *obj)
     { this->addString(obj); };
 
+    AddObjectFunc addObject = [this](Object *obj)
+    { this->addObject(obj); };
+
+    ResolveGlobalFunc resolveGlobal = [this](StringObject *name)
+    { return this->globalSlot(move(name)); };
+
     auto stringInternProps = StringInternProps{tryFindInternedString, addStringToIntern};
-    return Compiler{stringInternProps};
+    return Compiler{stringInternProps, addObject, resolveGlobal};
 }
 
 void Vm::setChunk(Chunk *chunk)
@@ -75,350 +251,540 @@ void Vm::setChunk(Chunk *chunk)
 
 InterpretResult Vm::run()
 {
-    auto frame = &frames[frameCount - 1];
-
-    auto readByte = [&frame]()
-    { return *frame->ip++; };
-    auto readShort = [&frame]()
-    {
-        frame->ip += 2;
-        return static_cast<uint16_t>((frame->ip[-2] << 8) | frame->ip[-1]);
-    };
-    auto readConstant = [&frame, &readByte]()
-    {
-        return frame->closure->function->chunk.getConstant(readByte());
+    CallFrame *frame;
+    uint8_t *ip;
+    Value *slots;
+    const Value *constants;
+    InlineCache *caches;
+
+    LOAD_FRAME();
+
+#ifdef COMPUTED_GOTO
+    static const void *dispatchTable[] = {
+#define OPCODE_LABEL(op) &&label_##op,
+        OPCODES(OPCODE_LABEL)
+#undef OPCODE_LABEL
     };
-    auto readString = [&readConstant]()
-    { return asString(readConstant()); };
-
-#ifdef DEBUG_TRACE_EXECUTION
-    auto disasm = Disassembler{&frame->closure->function->chunk};
 #endif
+
     for (;;)
     {
-#ifdef DEBUG_TRACE_EXECUTION
-        for (auto slot = stack.begin(); slot < stackTop; slot++)
-        {
-            std::cout << "[ ";
-            printValue(*slot);
-            std::cout << "] ";
-        }
-        std::cout << std::endl;
-        disasm.disassembleInstruction(frame->ip - frame->closure->function->chunk.getCodeBaseAddr());
-#endif
+        TRACE_INSTRUCTION();
 
-        auto instruction = static_cast<Opcode>(readByte());
-        switch (instruction)
+        switch (static_cast<Opcode>(READ_BYTE()))
         {
-        case Opcode::OP_CONSTANT:
-            push(readConstant());
-            break;
-        case Opcode::OP_NIL:
+        CASE(OP_CONSTANT):
+            push(READ_CONSTANT());
+            DISPATCH();
+        CASE(OP_CONSTANT_32):
+        {
+            uint32_t index = 0;
+            for (int i = 0; i < 4; i++)
+                index |= static_cast<uint32_t>(READ_BYTE()) << (8 * i);
+            push(constants[index]);
+        }
+            DISPATCH();
+        CASE(OP_NIL):
             push(NilVal);
-            break;
-        case Opcode::OP_TRUE:
+            DISPATCH();
+        CASE(OP_TRUE):
             push(TrueVal);
-            break;
-        case Opcode::OP_FALSE:
+            DISPATCH();
+        CASE(OP_FALSE):
             push(FalseVal);
-            break;
-        case Opcode::OP_POP:
+            DISPATCH();
+        CASE(OP_POP):
             pop();
-            break;
-        case Opcode::OP_GET_LOCAL:
+            DISPATCH();
+        CASE(OP_GET_LOCAL):
         {
-            auto slot = readByte();
-            push(frame->slots[slot]);
+            auto slot = READ_BYTE();
+            push(slots[slot]);
         }
-        break;
-        case Opcode::OP_SET_LOCAL:
+            DISPATCH();
+        CASE(OP_SET_LOCAL):
         {
-            auto slot = readByte();
-            frame->slots[slot] = peek(0);
+            auto slot = READ_BYTE();
+            slots[slot] = peek(0);
         }
-        break;
-        case Opcode::OP_GET_GLOBAL:
+            DISPATCH();
+        CASE(OP_GET_GLOBAL):
         {
-            auto name = readString();
-            // std::string s = name && name->str.size() > 0 ? name->str : "unknown";
-            // std::cout << "getting global from " << name << std::endl;
-            auto res = globals.get(name);
-            if (!res)
-            {
-                runtimeError("Undefined variable '%s'", name->str.c_str());
-                return InterpretResult::INTERPRET_RUNTIME_ERROR;
-            }
-            push(res.value());
+            auto slot = READ_SHORT();
+            auto &global = globals[slot];
+            if (!global.defined)
+                RUNTIME_ERROR("Undefined variable '%s'", globalNames[slot]->str.c_str());
+            push(global.value);
         }
-        break;
-        case Opcode::OP_DEFINE_GLOBAL:
+            DISPATCH();
+        CASE(OP_DEFINE_GLOBAL):
         {
-            auto name = readString();
-            globals.set(name, peek(0));
-            pop();
+            auto &global = globals[READ_SHORT()];
+            global.value = pop();
+            global.defined = true;
         }
-        break;
-        case Opcode::OP_SET_GLOBAL:
+            DISPATCH();
+        CASE(OP_SET_GLOBAL):
         {
-            auto name = readString();
-            if (globals.set(name, peek(0)))
-            {
-                globals.deleteKey(name);
-                runtimeError("Undefined variable '%s'", name->str.c_str());
-                return InterpretResult::INTERPRET_RUNTIME_ERROR;
-            }
+            auto slot = READ_SHORT();
+            auto &global = globals[slot];
+            if (!global.defined)
+                RUNTIME_ERROR("Undefined variable '%s'", globalNames[slot]->str.c_str());
+            global.value = peek(0);
         }
-        break;
-        case Opcode::OP_GET_UPVALUE:
+            DISPATCH();
+        CASE(OP_GET_UPVALUE):
         {
-            auto slot = readByte();
+            auto slot = READ_BYTE();
             push(*frame->closure->upvalues[slot]->location);
         }
-        break;
-        case Opcode::OP_SET_UPVALUE:
+            DISPATCH();
+        CASE(OP_SET_UPVALUE):
         {
-            auto slot = readByte();
-            *frame->closure->upvalues[slot]->location = peek(0);
+            auto upvalue = frame->closure->upvalues[READ_BYTE()];
+            *upvalue->location = stackTop[-1];
+            WRITE_BARRIER(upvalue, stackTop[-1]);
         }
-        break;
-        case Opcode::OP_GET_PROPERTY:
+            DISPATCH();
+        CASE(OP_GET_PROPERTY):
         {
             if (!isInstance(peek(0)))
+                RUNTIME_ERROR("Only instances have properties.");
+
+            auto instance = static_cast<InstanceObject *>(asObject(stackTop[-1]));
+            auto &name = READ_CONSTANT();
+            auto &cache = READ_INLINE_CACHE();
+            auto entry = cache.find(instance->shape);
+            if (entry && entry->method)
             {
-                runtimeError("Only instances have properties.");
-                return InterpretResult::INTERPRET_RUNTIME_ERROR;
+                STORE_FRAME();
+                auto boundMethod = createAndAddObject(newBoundMethod, stackTop[-1], entry->method);
+                stackTop[-1] = objectValue(boundMethod);
+                DISPATCH();
             }
-
-            auto instance = asInstance(peek(0));
-            auto name = readString();
-            auto res = instance->fields.get(name);
-            if (res)
+            else if (entry)
             {
-                pop(); // instance
-                push(res.value());
-                break;
+                stackTop[-1] = instance->fields[entry->slot];
+                DISPATCH();
             }
 
-            if (!bindMethod(instance->klass, name))
+            STORE_FRAME();
+            if (!getProperty(asString(name), cache))
                 return InterpretResult::INTERPRET_RUNTIME_ERROR;
         }
-        break;
-        case Opcode::OP_SET_PROPERTY:
+            DISPATCH();
+        CASE(OP_SET_PROPERTY):
         {
             if (!isInstance(peek(1)))
+                RUNTIME_ERROR("Only instances have fields.");
+
+            auto instance = static_cast<InstanceObject *>(asObject(stackTop[-2]));
+            auto &name = READ_CONSTANT();
+            auto &cache = READ_INLINE_CACHE();
+            auto entry = cache.find(instance->shape);
+            if (entry && entry->transition)
             {
-                runtimeError("Only instances have fields.");
-                return InterpretResult::INTERPRET_RUNTIME_ERROR;
+                auto before = objectSize(instance);
+                instance->fields.push_back(stackTop[-1]);
+                instance->shape = entry->transition;
+                accountGrowth(instance, before);
             }
+            else if (entry)
+                instance->fields[entry->slot] = stackTop[-1];
+            else
+                setProperty(asString(name), cache);
+            WRITE_BARRIER(instance, stackTop[-1]);
 
-            auto instance = asInstance(peek(1));
-            instance->fields.set(readString(), peek(0));
-            auto value = pop();
-            pop(); // instance
-            push(value);
+            stackTop[-2] = stackTop[-1];
+            stackTop--;
         }
-        break;
-        case Opcode::OP_GET_SUPER:
+            DISPATCH();
+        CASE(OP_GET_SUPER):
         {
-            auto name = readString();
+            auto name = READ_STRING();
             auto superclass = asClass(pop());
 
+            STORE_FRAME();
             if (!bindMethod(superclass, name))
                 return InterpretResult::INTERPRET_RUNTIME_ERROR;
         }
-        break;
-        case Opcode::OP_EQUAL:
+            DISPATCH();
+        CASE(OP_EQUAL):
         {
+            if (BOTH_NUMBERS())
+                QUICKEN(OP_EQUAL_NUM);
             auto b = pop();
             auto a = pop();
             push(boolValue(valuesEqual(a, b)));
         }
-        break;
-        case Opcode::OP_GREATER:
+            DISPATCH();
+        CASE(OP_GREATER):
             BINARY_OP(boolValue, >);
-            break;
-        case Opcode::OP_LESS:
+            QUICKEN(OP_GREATER_NUM);
+            DISPATCH();
+        CASE(OP_LESS):
             BINARY_OP(boolValue, <);
-            break;
-        case Opcode::OP_ADD:
-            if (isString(peek(0)) && isString(peek(1)))
-            {
-                concatenate();
-            }
-            else if (isNumber(peek(0)) && isNumber(peek(1)))
-            {
-                BINARY_OP(numberValue, +);
-            }
-            else if (isString(peek(0)) || isString(peek(1)))
-            {
-                auto b = pop();
-                auto a = pop();
-                pushObject(makeString(strValue(a) + strValue(b)));
-            }
-            else
-            {
-                runtimeError("Operands mismatch.");
-                return InterpretResult::INTERPRET_RUNTIME_ERROR;
-            }
-            break;
-        case Opcode::OP_SUBTRACT:
+            QUICKEN(OP_LESS_NUM);
+            DISPATCH();
+        CASE(OP_ADD):
+            if (BOTH_STRINGS())
+                QUICKEN(OP_ADD_STR);
+            else if (BOTH_NUMBERS())
+                QUICKEN(OP_ADD_NUM);
+            ADD_VALUES();
+            DISPATCH();
+        CASE(OP_SUBTRACT):
             BINARY_OP(numberValue, -);
-            break;
-        case Opcode::OP_DIVIDE:
+            QUICKEN(OP_SUBTRACT_NUM);
+            DISPATCH();
+        CASE(OP_DIVIDE):
             BINARY_OP(numberValue, /);
-            break;
-        case Opcode::OP_MULTIPLY:
+            QUICKEN(OP_DIVIDE_NUM);
+            DISPATCH();
+        CASE(OP_MULTIPLY):
             BINARY_OP(numberValue, *);
-            break;
-        case Opcode::OP_NOT:
+            QUICKEN(OP_MULTIPLY_NUM);
+            DISPATCH();
+        CASE(OP_NOT):
             push(boolValue(isFalsey(pop())));
-            break;
-        case Opcode::OP_NEGATE:
+            DISPATCH();
+        CASE(OP_NEGATE):
             if (!isNumber(peek(0)))
-            {
-                runtimeError("Operand must be a number.");
-                return InterpretResult::INTERPRET_RUNTIME_ERROR;
-            }
+                RUNTIME_ERROR("Operand must be a number.");
             push(numberValue(-asNumber(pop())));
-            break;
-        case Opcode::OP_PRINT:
-            printValue(pop());
+            DISPATCH();
+        CASE(OP_PRINT):
+        {
+            auto value = pop();
+            if (isString(value))
+                flatten(asString(value));
+            printValue(value);
             std::cout << std::endl;
-            break;
-        case Opcode::OP_JUMP:
+        }
+            DISPATCH();
+        CASE(OP_JUMP):
         {
-            auto offset = readShort();
-            frame->ip += offset;
+            auto offset = READ_SHORT();
+            ip += offset;
         }
-        break;
-        case Opcode::OP_JUMP_IF_FALSE:
+            DISPATCH();
+        CASE(OP_JUMP_IF_FALSE):
         {
-            auto offset = readShort();
+            auto offset = READ_SHORT();
             if (isFalsey(peek(0)))
-                frame->ip += offset;
+                ip += offset;
         }
-        break;
-        case Opcode::OP_LOOP:
+            DISPATCH();
+        CASE(OP_LOOP):
         {
-            auto offset = readShort();
-            frame->ip -= offset;
+            auto offset = READ_SHORT();
+            ip -= offset;
+            // Loops that do not allocate still answer a snapshot request.
+            if (heapSnapshotRequested)
+                writeRequestedSnapshot();
         }
-        break;
-        case Opcode::OP_CALL:
+            DISPATCH();
+        CASE(OP_CALL):
         {
-            auto argCount = readByte();
+            auto argCount = READ_BYTE();
+            STORE_FRAME();
             if (!callValue(peek(argCount), argCount))
                 return InterpretResult::INTERPRET_RUNTIME_ERROR;
 
-            frame = &frames[frameCount - 1];
+            LOAD_FRAME();
         }
-        break;
-        case Opcode::OP_INVOKE:
+            DISPATCH();
+        CASE(OP_TAIL_CALL):
         {
-            auto method = readString();
-            auto argCount = readByte();
+            auto argCount = READ_BYTE();
+            auto callee = peek(argCount);
+            // The common case reuses the frame in place, other callees push
+            // their frame as usual and it is moved down over this one.
+            if (isClosure(callee) && asClosure(callee)->function->arity == argCount)
+            {
+                closeUpvalues(slots);
+                stackTop = std::copy(stackTop - argCount - 1, stackTop, slots);
+                reserveStack(slots, asClosure(callee)->function->stackSize);
+                frame->closure = asClosure(callee);
+                frame->ip = frame->closure->function->chunk.getCodeBaseAddr();
+                frame->tailCalls++;
+                LOAD_FRAME();
+                DISPATCH();
+            }
 
-            if (!invoke(method, argCount))
+            STORE_FRAME();
+            auto callerCount = frameCount;
+            if (!callValue(callee, argCount))
                 return InterpretResult::INTERPRET_RUNTIME_ERROR;
 
-            frame = &frames[frameCount - 1];
+            // Natives and classes without an initializer leave their result
+            // on the stack for the OP_RETURN that follows.
+            if (frameCount > callerCount)
+            {
+                auto &called = frames[frameCount - 1];
+                auto &caller = frames[frameCount - 2];
+                closeUpvalues(caller.slots);
+                stackTop = std::copy(called.slots, stackTop, caller.slots);
+                caller.closure = called.closure;
+                caller.ip = called.ip;
+                caller.tailCalls++;
+                frameCount--;
+            }
+            LOAD_FRAME();
+        }
+            DISPATCH();
+        CASE(OP_INVOKE):
+        {
+            auto &method = READ_CONSTANT();
+            auto argCount = READ_BYTE();
+            auto &cache = READ_INLINE_CACHE();
+            auto &receiver = stackTop[-argCount - 1];
+
+            STORE_FRAME();
+            if (isInstance(receiver))
+            {
+                auto instance = static_cast<InstanceObject *>(asObject(receiver));
+                auto entry = cache.find(instance->shape);
+                if (entry && entry->method)
+                {
+                    if (!call(entry->method, argCount))
+                        return InterpretResult::INTERPRET_RUNTIME_ERROR;
+
+                    LOAD_FRAME();
+                    DISPATCH();
+                }
+            }
+
+            if (!invoke(asString(method), argCount, cache))
+                return InterpretResult::INTERPRET_RUNTIME_ERROR;
+
+            LOAD_FRAME();
         }
-        break;
-        case Opcode::OP_INVOKE_SUPER:
+            DISPATCH();
+        CASE(OP_INVOKE_SUPER):
         {
-            auto method = readString();
-            auto argCount = readByte();
+            auto method = READ_STRING();
+            auto argCount = READ_BYTE();
             auto superclass = asClass(pop());
 
+            STORE_FRAME();
             if (!invokeFromClass(superclass, method, argCount))
                 return InterpretResult::INTERPRET_RUNTIME_ERROR;
 
-            frame = &frames[frameCount - 1];
+            LOAD_FRAME();
         }
-        break;
-        case Opcode::OP_CLOSURE:
+            DISPATCH();
+        CASE(OP_CLOSURE):
         {
-            auto closure = createAndAddObject(newClosure, asFunction(readConstant()));
+            STORE_FRAME();
+            auto closure = createAndAddObject(newClosure, asFunction(READ_CONSTANT()));
             push(objectValue(closure));
             for (int i = 0; i < closure->upvalueCount; i++)
             {
-                auto isLocal = readByte();
-                auto index = readByte();
+                auto isLocal = READ_BYTE();
+                auto index = READ_BYTE();
                 if (isLocal)
                 {
-                    closure->upvalues[i] = captureUpvalue(frame->slots + index);
+                    closure->upvalues[i] = captureUpvalue(slots + index);
                 }
                 else
                 {
                     closure->upvalues[i] = frame->closure->upvalues[i];
                 }
+                // Capturing allocates, the closure may have been promoted.
+                WRITE_BARRIER(closure, objectValue(closure->upvalues[i]));
             }
         }
-        break;
-        case Opcode::OP_CLOSE_UPVALUE:
+            DISPATCH();
+        CASE(OP_CLOSE_UPVALUE):
             closeUpvalues(stackTop - 1);
             pop();
-            break;
-        case Opcode::OP_RETURN:
+            DISPATCH();
+        CASE(OP_RETURN):
         {
             auto result = pop();
-            closeUpvalues(frame->slots);
+            closeUpvalues(slots);
             frameCount--;
             if (frameCount == 0)
             {
                 pop();
-                gc.collectGarbage();
+#ifdef DEBUG_PRINT_QUICKENED
+                printQuickenedCode();
+#endif
+                gc.collectGarbage(true);
                 return InterpretResult::INTERPRET_OK;
             }
 
-            stackTop = frame->slots;
+            stackTop = slots;
             push(result);
-            frame = &frames[frameCount - 1];
+            LOAD_FRAME();
         }
-        break;
-        case Opcode::OP_INHERIT:
+            DISPATCH();
+        CASE(OP_INHERIT):
         {
             auto superclass = peek(1);
             if (!isClass(superclass))
-            {
-                runtimeError("Superclass must be a class.");
-                return InterpretResult::INTERPRET_RUNTIME_ERROR;
-            }
+                RUNTIME_ERROR("Superclass must be a class.");
             auto subclass = asClass(peek(0));
-            subclass->methods.addAll(asClass(superclass)->methods);
+            auto &methods = asClass(superclass)->methods;
+            auto before = objectSize(subclass);
+            subclass->methods.addAll(methods);
+            accountGrowth(subclass, before);
+            methods.forEach([&](StringObject *name, const Value &method)
+                            {
+                                WRITE_BARRIER(subclass, method);
+                                WRITE_BARRIER(subclass, objectValue(name));
+                            });
             pop(); // subclass
         }
-        break;
-        case Opcode::OP_CLASS:
+            DISPATCH();
+        CASE(OP_CLASS):
         {
-            auto klass = createAndAddObject(newClass, asString(readConstant()));
+            STORE_FRAME();
+            auto klass = createAndAddObject(newClass, asString(READ_CONSTANT()));
             push(objectValue(klass));
         }
-        break;
-        case Opcode::OP_METHOD:
-            defineMethod(readString());
-            break;
+            DISPATCH();
+        CASE(OP_METHOD):
+            defineMethod(READ_STRING());
+            DISPATCH();
+        CASE(OP_ADD_NUM):
+            if (BOTH_NUMBERS())
+                FAST_BINARY_OP(numberValue, +);
+            else
+                DEQUICKEN(OP_ADD);
+            DISPATCH();
+        CASE(OP_ADD_STR):
+            if (BOTH_STRINGS())
+            {
+                STORE_FRAME();
+                concatenate();
+            }
+            else
+                DEQUICKEN(OP_ADD);
+            DISPATCH();
+        CASE(OP_SUBTRACT_NUM):
+            if (BOTH_NUMBERS())
+                FAST_BINARY_OP(numberValue, -);
+            else
+                DEQUICKEN(OP_SUBTRACT);
+            DISPATCH();
+        CASE(OP_MULTIPLY_NUM):
+            if (BOTH_NUMBERS())
+                FAST_BINARY_OP(numberValue, *);
+            else
+                DEQUICKEN(OP_MULTIPLY);
+            DISPATCH();
+        CASE(OP_DIVIDE_NUM):
+            if (BOTH_NUMBERS())
+                FAST_BINARY_OP(numberValue, /);
+            else
+                DEQUICKEN(OP_DIVIDE);
+            DISPATCH();
+        CASE(OP_EQUAL_NUM):
+            if (BOTH_NUMBERS())
+                FAST_BINARY_OP(boolValue, ==);
+            else
+                DEQUICKEN(OP_EQUAL);
+            DISPATCH();
+        CASE(OP_GREATER_NUM):
+            if (BOTH_NUMBERS())
+                FAST_BINARY_OP(boolValue, >);
+            else
+                DEQUICKEN(OP_GREATER);
+            DISPATCH();
+        CASE(OP_LESS_NUM):
+            if (BOTH_NUMBERS())
+                FAST_BINARY_OP(boolValue, <);
+            else
+                DEQUICKEN(OP_LESS);
+            DISPATCH();
+        CASE(OP_ADD_LOCALS):
+        {
+            auto &a = slots[READ_BYTE()];
+            auto &b = slots[READ_BYTE()];
+            if (isNumber(a) && isNumber(b))
+                push(numberValue(asNumber(a) + asNumber(b)));
+            else
+            {
+                push(a);
+                push(b);
+                ADD_VALUES();
+            }
+        }
+            DISPATCH();
+        CASE(OP_SUBTRACT_LOCALS):
+            LOCALS_BINARY_OP(numberValue, -);
+            DISPATCH();
+        CASE(OP_MULTIPLY_LOCALS):
+            LOCALS_BINARY_OP(numberValue, *);
+            DISPATCH();
+        CASE(OP_DIVIDE_LOCALS):
+            LOCALS_BINARY_OP(numberValue, /);
+            DISPATCH();
+        CASE(OP_LESS_LOCAL_CONST_JUMP):
+            LOCAL_CONST_JUMP(<);
+            DISPATCH();
+        CASE(OP_GREATER_LOCAL_CONST_JUMP):
+            LOCAL_CONST_JUMP(>);
+            DISPATCH();
+        CASE(OP_POP_JUMP_IF_FALSE):
+        {
+            auto offset = READ_SHORT();
+            if (isFalsey(pop()))
+                ip += offset;
+        }
+            DISPATCH();
         default:
-            break;
+            RUNTIME_ERROR("Unknown opcode.");
         }
     }
     return InterpretResult::INTERPRET_RUNTIME_ERROR;
 }
 
+void Vm::traceInstruction(const CallFrame *frame, const uint8_t *ip)
+{
+    for (auto slot = stack.data(); slot < stackTop; slot++)
+    {
+        std::cout << "[ ";
+        printValue(*slot);
+        std::cout << "] ";
+    }
+    std::cout << std::endl;
+    auto &chunk = frame->closure->function->chunk;
+    Disassembler{&chunk}.disassembleInstruction(ip - chunk.getCodeBaseAddr());
+}
+
+void Vm::printQuickenedCode()
+{
+    for (auto list : {objects, oldObjects, unsweptObjects})
+    {
+        for (auto object = list; object; object = object->next)
+        {
+            if (object->type != ObjectType::OBJECT_FUNCTION)
+                continue;
+
+            auto function = static_cast<FunctionObject *>(object);
+            Disassembler disasm{&function->chunk};
+            disasm.disassembleChunk(function->name ? function->name->str : "<script>");
+        }
+    }
+}
+
 void Vm::push(Value val)
 {
     *stackTop = move(val);
     stackTop++;
 }
 
-void Vm::pushObject(shared_ptr<Object> obj)
+void Vm::pushObject(Object *obj)
 {
     push(objectValue(move(obj)));
 }
 
 Value Vm::pop()
 {
-    if (stackTop == stack.begin())
+    if (stackTop == stack.data())
         throw std::runtime_error("Empty stack.");
 
     stackTop--;
@@ -430,7 +796,7 @@ Value Vm::peek(int distance)
     return *(stackTop - 1 - distance);
 }
 
-bool Vm::call(shared_ptr<ClosureObject> closure, int argCount)
+bool Vm::call(ClosureObject *closure, int argCount)
 {
     if (closure->function->arity != argCount)
     {
@@ -438,19 +804,54 @@ bool Vm::call(shared_ptr<ClosureObject> closure, int argCount)
         return false;
     }
 
-    if (frameCount == FRAMES_MAX)
+    if (frameCount == static_cast<int>(frames.size()))
     {
-        runtimeError("Stack overflow.");
-        return false;
+        if (frameCount >= maxFrames)
+        {
+            runtimeError("Stack overflow.");
+            return false;
+        }
+        frames.resize(std::min(frameCount * 2, maxFrames));
     }
 
+    reserveStack(stackTop - argCount - 1, closure->function->stackSize);
+
     auto frame = &frames[frameCount++];
     frame->closure = closure;
     frame->ip = closure->function->chunk.getCodeBaseAddr();
     frame->slots = stackTop - argCount - 1;
+    frame->tailCalls = 0;
     return true;
 }
 
+// Makes room for a frame at slots that needs size values.
+void Vm::reserveStack(Value *slots, int size)
+{
+    auto needed = static_cast<std::size_t>(slots - stack.data()) + size + STACK_HEADROOM;
+    if (needed > stack.size())
+        growStack(needed);
+}
+
+// Moves the values to a stack at least twice the size. Frames and open
+// upvalues point into the stack, run() reloads its copy of slots after every
+// call.
+void Vm::growStack(std::size_t needed)
+{
+    std::vector<Value> grown(std::max(stack.size() * 2, needed));
+    std::copy(stack.data(), stackTop, grown.data());
+    auto relocate = [&](Value *slot) { return grown.data() + (slot - stack.data()); };
+    for (int i = 0; i < frameCount; i++)
+    {
+        frames[i].slots = relocate(frames[i].slots);
+    }
+    for (auto upvalue = openUpvalues; upvalue; upvalue = upvalue->nextUpvalue)
+    {
+        upvalue->location = relocate(upvalue->location);
+    }
+    stackTop = relocate(stackTop);
+    stack.swap(grown);
+}
+
 bool Vm::callValue(Value callee, int argCount)
 {
     if (isObject(callee))
@@ -466,7 +867,7 @@ bool Vm::callValue(Value callee, int argCount)
         case ObjectType::OBJECT_CLASS:
         {
             auto klass = asClass(callee);
-            stackTop[-argCount - 1] = objectValue(newInstance(klass));
+            stackTop[-argCount - 1] = objectValue(createAndAddObject(newInstance, klass));
             auto init = klass->methods.get(initString);
             if (init)
                 return call(asClosure(init.value()), argCount);
@@ -496,7 +897,7 @@ bool Vm::callValue(Value callee, int argCount)
     return false;
 }
 
-bool Vm::invokeFromClass(shared_ptr<ClassObject> &klass, shared_ptr<StringObject> &name, int argCount)
+bool Vm::invokeFromClass(ClassObject *klass, StringObject *name, int argCount)
 {
     auto method = klass->methods.get(name);
     if (!method)
@@ -508,7 +909,7 @@ bool Vm::invokeFromClass(shared_ptr<ClassObject> &klass, shared_ptr<StringObject
     return call(asClosure(method.value()), argCount);
 }
 
-bool Vm::invoke(shared_ptr<StringObject> &name, int argCount)
+bool Vm::invoke(StringObject *name, int argCount, InlineCache &cache)
 {
     auto receiver = peek(argCount);
     if (!isInstance(receiver))
@@ -518,17 +919,76 @@ bool Vm::invoke(shared_ptr<StringObject> &name, int argCount)
     }
     auto instance = asInstance(receiver);
 
-    auto field = instance->fields.get(name);
-    if (field)
+    auto slot = instance->shape->findSlot(name);
+    if (slot >= 0)
+    {
+        auto field = instance->fields[slot];
+        stackTop[-argCount - 1] = field;
+        return callValue(field, argCount);
+    }
+
+    auto method = instance->klass->methods.get(name);
+    if (!method)
+    {
+        runtimeError("Undefined property '%s'.", name->str.c_str());
+        return false;
+    }
+
+    auto closure = asClosure(method.value());
+    updateInlineCache(cache, InlineCacheEntry{instance->klass, instance->shape, -1, closure});
+    return call(move(closure), argCount);
+}
+
+bool Vm::getProperty(StringObject *name, InlineCache &cache)
+{
+    auto instance = asInstance(peek(0));
+    auto slot = instance->shape->findSlot(name);
+    if (slot >= 0)
     {
-        stackTop[-argCount - 1] = field.value();
-        return callValue(field.value(), argCount);
+        updateInlineCache(cache, InlineCacheEntry{instance->klass, instance->shape, slot});
+        stackTop[-1] = instance->fields[slot];
+        return true;
     }
 
-    return invokeFromClass(instance->klass, name, argCount);
+    auto method = instance->klass->methods.get(name);
+    if (method)
+        updateInlineCache(cache, InlineCacheEntry{instance->klass, instance->shape, -1, asClosure(method.value())});
+
+    return bindMethod(instance->klass, name);
+}
+
+void Vm::setProperty(StringObject *name, InlineCache &cache)
+{
+    auto instance = asInstance(peek(1));
+    auto shape = instance->shape;
+    auto slot = shape->findSlot(name);
+    if (slot >= 0)
+    {
+        instance->fields[slot] = peek(0);
+        updateInlineCache(cache, InlineCacheEntry{instance->klass, shape, slot});
+        return;
+    }
+
+    auto instanceBefore = objectSize(instance);
+    auto classBefore = objectSize(instance->klass);
+    instance->shape = shape->addField(name);
+    instance->fields.push_back(peek(0));
+    accountGrowth(instance, instanceBefore);
+    accountGrowth(instance->klass, classBefore);
+    // The class owns the shape tree and with it the new field name.
+    WRITE_BARRIER(instance->klass, objectValue(name));
+    updateInlineCache(cache, InlineCacheEntry{instance->klass, shape, -1, nullptr, instance->shape});
+}
+
+void Vm::updateInlineCache(InlineCache &cache, InlineCacheEntry entry)
+{
+    // Caches belong to the running function, the entry keeps its class alive.
+    auto function = frames[frameCount - 1].closure->function;
+    WRITE_BARRIER(function, objectValue(entry.klass));
+    cache.update(move(entry));
 }
 
-bool Vm::bindMethod(shared_ptr<ClassObject> &klass, shared_ptr<StringObject> &name)
+bool Vm::bindMethod(ClassObject *klass, StringObject *name)
 {
     auto res = klass->methods.get(name);
     if (!res)
@@ -543,23 +1003,23 @@ bool Vm::bindMethod(shared_ptr<ClassObject> &klass, shared_ptr<StringObject> &na
     return true;
 }
 
-shared_ptr<UpvalueObject> Vm::captureUpvalue(Value *local)
+UpvalueObject *Vm::captureUpvalue(Value *local)
 {
-    shared_ptr<UpvalueObject> prevUpvalue{};
-    auto upvalue = dynamic_pointer_cast<UpvalueObject>(openUpvalues);
+    UpvalueObject *prevUpvalue = nullptr;
+    auto upvalue = openUpvalues;
     while (upvalue && upvalue->location > local)
     {
         prevUpvalue = upvalue;
-        upvalue = dynamic_pointer_cast<UpvalueObject>(upvalue->next);
+        upvalue = upvalue->nextUpvalue;
     }
 
     if (upvalue && upvalue->location == local)
         return upvalue;
 
     auto createdUpvalue = createAndAddObject(newUpvalue, local);
-    createdUpvalue->next = upvalue;
+    createdUpvalue->nextUpvalue = upvalue;
     if (prevUpvalue)
-        prevUpvalue->next = createdUpvalue;
+        prevUpvalue->nextUpvalue = createdUpvalue;
     else
         openUpvalues = createdUpvalue;
 
@@ -573,15 +1033,20 @@ void Vm::closeUpvalues(Value *last)
         auto upvalue = openUpvalues;
         upvalue->closed = *upvalue->location;
         upvalue->location = &upvalue->closed;
-        openUpvalues = dynamic_pointer_cast<UpvalueObject>(upvalue->next);
+        WRITE_BARRIER(upvalue, upvalue->closed);
+        openUpvalues = upvalue->nextUpvalue;
     }
 }
 
-void Vm::defineMethod(shared_ptr<StringObject> name)
+void Vm::defineMethod(StringObject *name)
 {
     auto method = peek(0);
     auto klass = asClass(peek(1));
-    klass->methods.set(move(name), move(method));
+    auto before = objectSize(klass);
+    klass->methods.set(name, method);
+    accountGrowth(klass, before);
+    WRITE_BARRIER(klass, method);
+    WRITE_BARRIER(klass, objectValue(name));
     pop();
 }
 
@@ -595,6 +1060,13 @@ void Vm::runtimeError(const char *format, ...)
 
     for (int i = frameCount - 1; i >= 0; i--)
     {
+        if (i == frameCount - 1 - TRACE_FRAMES && i > TRACE_FRAMES)
+        {
+            fprintf(stderr, "... %d more frames\n", i - TRACE_FRAMES + 1);
+            i = TRACE_FRAMES;
+            continue;
+        }
+
         auto &frame = frames[i];
         auto &chunk = frame.closure->function->chunk;
         auto instruction = frame.ip - chunk.getCodeBaseAddr() - 1;
@@ -605,6 +1077,8 @@ void Vm::runtimeError(const char *format, ...)
                 : "script";
 
         fprintf(stderr, "[line %d] in %s\n", line, name);
+        if (frame.tailCalls)
+            fprintf(stderr, "... %llu tail calls\n", static_cast<unsigned long long>(frame.tailCalls));
     }
     resetStack();
 }
@@ -613,14 +1087,26 @@ void Vm::defineNative(std::string name, NativeFn function)
 {
     push(objectValue(makeString(move(name))));
     push(objectValue(createAndAddObject(newNative, function)));
-    globals.set(asString(peek(1)), peek(0));
+    globals[globalSlot(asString(peek(1)))] = GlobalVariable{peek(0), true};
     pop();
     pop();
 }
 
+int Vm::globalSlot(StringObject *name)
+{
+    auto slot = globalSlots.get(name);
+    if (slot)
+        return static_cast<int>(asNumber(slot.value()));
+
+    globals.emplace_back();
+    globalNames.push_back(name);
+    globalSlots.set(move(name), numberValue(globals.size() - 1));
+    return globals.size() - 1;
+}
+
 void Vm::resetStack()
 {
-    stackTop = &stack[0];
+    stackTop = stack.data();
     frameCount = 0;
 }
 
@@ -629,22 +1115,61 @@ bool Vm::isFalsey(Value val)
     return isNil(val) || (isBool(val) && !asBool(val));
 }
 
+// Joins the two strings on top of the stack. Long results are ropes, so
+// building a string piece by piece takes linear time. Short pieces appended
+// to a rope are merged into its right leaf to keep the rope shallow.
 void Vm::concatenate()
 {
     auto b = asString(peek(0));
     auto a = asString(peek(1));
-    auto s = makeString(a->str + b->str);
+    StringObject *s;
+    if (a->length + b->length < ROPE_MIN_LENGTH)
+        s = createAndAddObject(newString, a->str + b->str);
+    else if (a->isRope() && !a->right->isRope() && !b->isRope() && a->right->length + b->length < ROPE_MIN_LENGTH)
+    {
+        // Leaves are only reached through the rope, they are not interned.
+        // The new one stays on the stack while the rope is allocated.
+        pushObject(createAndAddObject(newString, a->right->str + b->str));
+        s = createAndAddObject(newRope, a->left, asString(peek(0)));
+        pop();
+    }
+    else
+        s = createAndAddObject(newRope, a, b);
     pop();
     pop();
     pushObject(move(s));
 }
 
+// Replaces a value by its string for a concatenation.
+void Vm::stringifyOperand(Value &value)
+{
+    if (!isString(value))
+        value = objectValue(createAndAddObject(newString, strValue(value)));
+}
+
+// Copies the characters of a rope into its str. The halves are no longer
+// referenced, the Gc frees them when nothing else does.
+void Vm::flatten(StringObject *string)
+{
+    if (!string->isRope())
+        return;
+
+    auto before = objectSize(string);
+    std::string str;
+    str.reserve(string->length);
+    appendString(str, string);
+    string->str = move(str);
+    string->left = nullptr;
+    string->right = nullptr;
+    accountGrowth(string, before);
+}
+
 bool Vm::valuesEqual(Value &val1, Value &val2)
 {
-    if (val1.type != val2.type)
+    if (valueType(val1) != valueType(val2))
         return false;
 
-    switch (val1.type)
+    switch (valueType(val1))
     {
     case ValueType::VAL_BOOL:
         return asBool(val1) == asBool(val2);
@@ -653,72 +1178,163 @@ bool Vm::valuesEqual(Value &val1, Value &val2)
     case ValueType::VAL_NUMBER:
         return asNumber(val1) == asNumber(val2);
     case ValueType::VAL_OBJ:
-        return asObject(val1) == asObject(val2);
+    {
+        if (asObject(val1) == asObject(val2))
+            return true;
+        if (!isString(val1) || !isString(val2))
+            return false;
+
+        // Strings are interned when they are first compared, later
+        // comparisons of them are identity checks.
+        auto a = asString(val1);
+        auto b = asString(val2);
+        if ((a->isInterned && b->isInterned) || a->length != b->length)
+            return false;
+        return intern(a) == intern(b);
+    }
     }
 }
 
-shared_ptr<StringObject> Vm::makeString(std::string str)
+StringObject *Vm::makeString(std::string str)
 {
-    auto found = findString(str);
+    auto hash = hashString(str);
+    auto found = findString(str, hash);
     if (found)
         return found.value();
 
-    auto obj = createAndAddObject(newString, move(str));
+    auto obj = createAndAddObject(newHashedString, move(str), hash);
     addString(obj);
     return obj;
 }
 
-optional<shared_ptr<StringObject>> Vm::findString(std::string &str)
+optional<StringObject *> Vm::findString(std::string_view str, std::uint32_t hash)
 {
-    return strings.findKey(str, hashString(str));
+    return strings.findKey(str, hash);
 }
 
-void Vm::addString(shared_ptr<StringObject> obj)
+// Returns the interned string equal to string, string itself if there was
+// none.
+StringObject *Vm::intern(StringObject *string)
 {
+    if (string->isInterned)
+        return string;
+
+    flatten(string);
+    auto found = strings.findKey(string->str, string->getHash());
+    if (found)
+        return found.value();
+
+    addString(string);
+    return string;
+}
+
+void Vm::addString(StringObject *obj)
+{
+    obj->getHash();
+    obj->isInterned = true;
     strings.set(move(obj), NilVal);
 }
 
 template <ConceptObject T, typename... Args>
-shared_ptr<T> Vm::createAndAddObject(shared_ptr<T> (*factory)(Args...), Args... args)
+T *Vm::createAndAddObject(T *(*factory)(Args...), Args... args)
 {
+    // Collect before the object exists, it is not reachable from any root yet.
+    collectGarbageIfNeeded();
     auto obj = factory(std::forward<Args>(args)...);
     addObject(obj);
 
 #ifdef DEBUG_LOG_GC
-    // std::cout << std::to_address(obj.get()) << " allocate for " << static_cast<int>(obj->type) << std::endl;
+    // std::cout << obj << " allocate for " << static_cast<int>(obj->type) << std::endl;
 #endif
-    collectGarbageIfNeeded<T>();
     return obj;
 }
 
 template <ConceptObject T>
-shared_ptr<T> Vm::createAndAddObject(shared_ptr<T> (*factory)())
+T *Vm::createAndAddObject(T *(*factory)())
 {
+    collectGarbageIfNeeded();
     auto obj = factory();
     addObject(obj);
 
 #ifdef DEBUG_LOG_GC
-    // std::cout << std::to_address(obj.get()) << " allocate for " << static_cast<int>(obj->type) << std::endl;
+    // std::cout << obj << " allocate for " << static_cast<int>(obj->type) << std::endl;
 #endif
-    collectGarbageIfNeeded<T>();
     return obj;
 }
 
-template <ConceptObject T>
 void Vm::collectGarbageIfNeeded()
 {
-    gc.addToBytesAllocated(sizeof(T));
+    if (heapSnapshotRequested)
+        writeRequestedSnapshot();
     if (gc.shouldCollect())
         gc.collectGarbage();
 }
 
-void Vm::addObject(shared_ptr<Object> obj)
+// Accounts for the containers of object having changed size since it
+// measured before bytes. They shrink when a table rebuild frees the old
+// storage, the object is freed at its size then.
+void Vm::accountGrowth(Object *object, std::size_t before)
 {
+    auto after = objectSize(object);
+    if (after > before)
+        gc.addToBytesAllocated(after - before);
+    else if (after < before)
+        gc.releaseBytes(before - after);
+}
+
+void Vm::addObject(Object *obj)
+{
+    gc.addToBytesAllocated(objectSize(obj));
     obj->next = objects;
     objects = obj;
+    if (gc.isMarking())
+        gc.allocateBlack(obj);
+    if (profiler)
+        sampleAllocation(obj);
+}
+
+void Vm::sampleAllocation(Object *obj)
+{
+    auto size = objectSize(obj);
+    if (profiler->shouldSample(size))
+        profiler->recordAllocation(obj, size, allocationStack());
+}
+
+// The Lox call stack as a folded stack, outermost frame first. Frames below
+// the top one have saved their ip at the call, the interpreter loop saves the
+// top one before it allocates.
+std::string Vm::allocationStack()
+{
+    if (frameCount == 0)
+        return "<compile>";
+
+    std::string stack;
+    for (int i = 0; i < frameCount; i++)
+    {
+        auto &frame = frames[i];
+        auto function = frame.closure->function;
+        auto &chunk = function->chunk;
+        auto instruction = frame.ip - chunk.getCodeBaseAddr() - 1;
+        if (i > 0)
+            stack += ";";
+        stack += function->name ? function->name->str : "script";
+        stack += ":" + std::to_string(chunk.getLine(instruction));
+    }
+    return stack;
 }
 
 void Vm::freeObjects()
 {
-    objects = shared_ptr<Object>();
+    for (auto list : {objects, oldObjects, unsweptObjects})
+    {
+        while (list)
+        {
+            auto next = list->next;
+            freeObject(list);
+            list = next;
+        }
+    }
+    objects = nullptr;
+    oldObjects = nullptr;
+    unsweptObjects = nullptr;
 }
\ No newline at end of file
@@ -12,6 +12,8 @@
 #include "table.hpp"
 #include "compiler.hpp"
 #include "gc.hpp"
+#include "heapprofiler.hpp"
+#include "heapsnapshot.hpp"
 
 enum class InterpretResult
 {
@@ -20,8 +22,16 @@ enum class InterpretResult
     INTERPRET_RUNTIME_ERROR,
 };
 
-#define FRAMES_MAX 64
-#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+// The value and frame stacks start small and double when a call needs more,
+// up to FRAMES_MAX frames unless --max-frames says otherwise.
+#define FRAMES_MAX 100000
+#define FRAMES_INITIAL 64
+#define STACK_INITIAL 1024
+// Slots reserved past a function's stack size, for the values instructions
+// like concatenation push for a moment.
+#define STACK_HEADROOM 16
+// A runtime error prints this many of the innermost and outermost frames.
+#define TRACE_FRAMES 10
 
 template <typename T>
 concept ConceptObject = std::is_base_of<Object, T>::value;
@@ -30,63 +40,104 @@ struct CallFrame
 {
     explicit CallFrame() = default;
 
-    std::shared_ptr<ClosureObject> closure{};
+    ClosureObject *closure{};
     std::uint8_t *ip = nullptr;
     Value *slots = nullptr;
+    // Frames the tail calls made in this frame replaced.
+    std::uint64_t tailCalls = 0;
+};
+
+struct GlobalVariable
+{
+    Value value{NilVal};
+    bool defined = false;
 };
 
 class Vm
 {
 public:
     explicit Vm();
+    explicit Vm(GcOptions);
+    ~Vm();
     InterpretResult interpret(std::string &);
+    void enableHeapProfile(std::string, std::size_t);
+    bool writeHeapSnapshot(const std::string &);
+    void setMaxFrames(int);
+    // The running Vm, for natives that inspect it.
+    static Vm *current;
 
 private:
     friend Gc;
+    friend HeapSnapshot;
     Compiler createCompiler();
     void setChunk(Chunk *);
     InterpretResult run();
+    void traceInstruction(const CallFrame *, const std::uint8_t *);
+    void printQuickenedCode();
     void push(Value);
-    void pushObject(std::shared_ptr<Object>);
+    void pushObject(Object *);
     Value pop();
     Value peek(int);
-    bool call(std::shared_ptr<ClosureObject>, int);
+    bool call(ClosureObject *, int);
     bool callValue(Value, int);
-    bool invokeFromClass(std::shared_ptr<ClassObject> &, std::shared_ptr<StringObject> &, int);
-    bool invoke(std::shared_ptr<StringObject> &, int);
-    bool bindMethod(std::shared_ptr<ClassObject> &, std::shared_ptr<StringObject> &);
-    std::shared_ptr<UpvalueObject> captureUpvalue(Value *);
+    void reserveStack(Value *, int);
+    void growStack(std::size_t);
+    bool invokeFromClass(ClassObject *, StringObject *, int);
+    bool invoke(StringObject *, int, InlineCache &);
+    bool getProperty(StringObject *, InlineCache &);
+    void setProperty(StringObject *, InlineCache &);
+    void updateInlineCache(InlineCache &, InlineCacheEntry);
+    bool bindMethod(ClassObject *, StringObject *);
+    UpvalueObject *captureUpvalue(Value *);
     void closeUpvalues(Value *);
-    void defineMethod(std::shared_ptr<StringObject>);
+    void defineMethod(StringObject *);
     void runtimeError(const char *, ...);
     void defineNative(std::string, NativeFn);
+    int globalSlot(StringObject *);
     void resetStack();
     bool isFalsey(Value);
     bool valuesEqual(Value &, Value &);
     void concatenate();
-    std::shared_ptr<StringObject> makeString(std::string);
-    std::optional<std::shared_ptr<StringObject>> findString(std::string &);
-    void addString(std::shared_ptr<StringObject>);
+    void stringifyOperand(Value &);
+    void flatten(StringObject *);
+    StringObject *makeString(std::string);
+    std::optional<StringObject *> findString(std::string_view, std::uint32_t);
+    StringObject *intern(StringObject *);
+    void addString(StringObject *);
     template <ConceptObject T, typename... Args>
-    std::shared_ptr<T> createAndAddObject(std::shared_ptr<T> (*)(Args...), Args...);
-    template <ConceptObject T>
-    std::shared_ptr<T> createAndAddObject(std::shared_ptr<T> (*)());
+    T *createAndAddObject(T *(*)(Args...), Args...);
     template <ConceptObject T>
+    T *createAndAddObject(T *(*)());
     void collectGarbageIfNeeded();
-    void addObject(std::shared_ptr<Object>);
+    void writeRequestedSnapshot();
+    void accountGrowth(Object *, std::size_t);
+    void addObject(Object *);
+    void sampleAllocation(Object *);
+    std::string allocationStack();
     void freeObjects();
     const std::uint8_t *ip = nullptr;
     Chunk *chunk = nullptr;
     std::span<const uint8_t> code;
-    std::array<Value, STACK_MAX> stack;
+    std::vector<Value> stack;
     Value *stackTop = nullptr;
-    std::shared_ptr<Object> objects{};
-    Table globals;
+    Arena arena;
+    Object *objects{};
+    Object *oldObjects{};
+    // Old objects the last major collection has not swept yet.
+    Object *unsweptObjects{};
+    // Global variables live in slots handed out at compile time, globalSlots
+    // maps names to them so later compilations (the REPL) reuse the slot.
+    std::vector<GlobalVariable> globals;
+    std::vector<StringObject *> globalNames;
+    Table globalSlots;
     Table strings;
-    std::array<CallFrame, FRAMES_MAX> frames;
+    std::vector<CallFrame> frames;
     int frameCount = 0;
-    std::shared_ptr<UpvalueObject> openUpvalues{};
+    int maxFrames = FRAMES_MAX;
+    UpvalueObject *openUpvalues{};
     Gc gc;
-    std::shared_ptr<StringObject> initString{};
+    StringObject *initString{};
+    std::unique_ptr<HeapProfiler> profiler;
+    int snapshotCount = 0;
 };
 #endif
\ No newline at end of file
@@ -0,0 +1,64 @@
+# Runs a script under vlox with --gc-stats and checks what it printed and the
+# statistics reported on exit.
+#   VLOX            path of the interpreter
+#   SCRIPT          the Lox script
+#   ARGS            options passed before the script, space separated
+#   OUTPUT          expected standard output, without the last newline
+#   MIN_MAJOR       least number of major collections
+#   MAX_PEAK_HEAP   bound on the peak heap in bytes
+#   EXIT_LENGTHS    runs a copy of the script for each of these values of its
+#                   exitLength variable instead, space separated
+#   LOG_MATCH       regular expression the --gc-log output of at least one run
+#                   has to match
+
+separate_arguments(args UNIX_COMMAND "${ARGS}")
+if(DEFINED LOG_MATCH)
+    list(APPEND args --gc-log)
+endif()
+
+function(check_run script)
+    execute_process(COMMAND ${VLOX} ${args} --gc-stats ${script}
+                    OUTPUT_VARIABLE out ERROR_VARIABLE err RESULT_VARIABLE result)
+    if(NOT result EQUAL 0)
+        message(FATAL_ERROR "${script}: vlox exited with ${result}\n${err}")
+    endif()
+    if(DEFINED OUTPUT AND NOT out STREQUAL "${OUTPUT}\n")
+        message(FATAL_ERROR "${script}: expected output '${OUTPUT}', got '${out}'")
+    endif()
+
+    string(REGEX MATCH "collections: [0-9]+ minor, ([0-9]+) major" _ "${err}")
+    set(major ${CMAKE_MATCH_1})
+    string(REGEX MATCH "peak heap: ([0-9]+) bytes" _ "${err}")
+    set(peak ${CMAKE_MATCH_1})
+    if(major STREQUAL "" OR peak STREQUAL "")
+        message(FATAL_ERROR "${script}: no gc stats in\n${err}")
+    endif()
+    if(DEFINED MIN_MAJOR AND major LESS MIN_MAJOR)
+        message(FATAL_ERROR "${script}: ${major} major collections, expected at least ${MIN_MAJOR}")
+    endif()
+    if(DEFINED MAX_PEAK_HEAP AND peak GREATER MAX_PEAK_HEAP)
+        message(FATAL_ERROR "${script}: peak heap ${peak} bytes, expected at most ${MAX_PEAK_HEAP}")
+    endif()
+    if(DEFINED LOG_MATCH AND err MATCHES "${LOG_MATCH}")
+        set(log_matched TRUE PARENT_SCOPE)
+    endif()
+    message(STATUS "${script}: ${major} major collections, peak heap ${peak} bytes")
+endfunction()
+
+set(log_matched FALSE)
+if(DEFINED EXIT_LENGTHS)
+    file(READ ${SCRIPT} source)
+    get_filename_component(name ${SCRIPT} NAME_WE)
+    separate_arguments(lengths UNIX_COMMAND "${EXIT_LENGTHS}")
+    foreach(length ${lengths})
+        string(REPLACE "var exitLength = 0;" "var exitLength = ${length};" variant "${source}")
+        file(WRITE ${name}_${length}.lox "${variant}")
+        check_run(${name}_${length}.lox)
+    endforeach()
+else()
+    check_run(${SCRIPT})
+endif()
+
+if(DEFINED LOG_MATCH AND NOT log_matched)
+    message(FATAL_ERROR "no run logged a match for '${LOG_MATCH}'")
+endif()
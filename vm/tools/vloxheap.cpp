@@ -0,0 +1,314 @@
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <unordered_map>
+#include <map>
+#include <cstdlib>
+
+// Reads a heap snapshot written by vlox (heapSnapshot() or SIGUSR1) and
+// reports what keeps memory alive. An object's retained size is what would
+// be freed if it died, the shallow sizes of the objects it dominates: every
+// path from the roots to them passes through it.
+
+using std::size_t;
+using std::string;
+using std::vector;
+
+#define DEFAULT_TOP 20
+
+struct Node
+{
+    string address;
+    string type;
+    string label;
+    size_t size = 0;
+    size_t retained = 0;
+    vector<int> references;
+    vector<int> predecessors;
+    int idom = -1;
+    int order = -1;
+};
+
+// Node 0 stands for the roots, it references every root.
+struct Graph
+{
+    vector<Node> nodes;
+    std::unordered_map<string, int> indices;
+    size_t unreachableObjects = 0;
+    size_t unreachableBytes = 0;
+
+    int indexOf(const string &address)
+    {
+        auto [it, inserted] = indices.try_emplace(address, static_cast<int>(nodes.size()));
+        if (inserted)
+        {
+            nodes.emplace_back();
+            nodes.back().address = address;
+        }
+        return it->second;
+    }
+};
+
+[[noreturn]] void usage()
+{
+    std::cout << "Usage: vlox-heap [options] <snapshot>" << std::endl;
+    std::cout << "  --top=<n>             objects to list by retained size" << std::endl;
+    std::cout << "  --path=<address>      print the dominators keeping an object alive" << std::endl;
+    std::exit(65);
+}
+
+[[noreturn]] void fail(const string &message)
+{
+    std::cerr << "vlox-heap: " << message << std::endl;
+    std::exit(1);
+}
+
+Graph readSnapshot(const char *filename)
+{
+    std::ifstream input(filename);
+    if (input.fail())
+        fail("invalid file " + string{filename});
+
+    Graph graph;
+    graph.indexOf("roots");
+    graph.nodes[0].type = "roots";
+
+    string line;
+    std::getline(input, line);
+    if (!line.starts_with("vlox-heap-snapshot 1"))
+        fail("not a heap snapshot: " + string{filename});
+
+    while (std::getline(input, line))
+    {
+        std::istringstream record(line);
+        string kind;
+        record >> kind;
+        if (kind == "root")
+        {
+            string rootKind, address;
+            record >> rootKind >> address;
+            if (record.fail())
+                fail("malformed record: " + line);
+            auto index = graph.indexOf(address);
+            graph.nodes[0].references.push_back(index);
+        }
+        else if (kind == "object")
+        {
+            string address, type;
+            size_t size, count;
+            record >> address >> type >> size >> count;
+            auto index = graph.indexOf(address);
+            vector<int> references(count);
+            for (auto &reference : references)
+            {
+                string target;
+                record >> target;
+                reference = graph.indexOf(target);
+            }
+            if (record.fail())
+                fail("malformed record: " + line);
+
+            auto &node = graph.nodes[index];
+            node.type = type;
+            node.size = size;
+            node.references = std::move(references);
+            // The label is the rest of the line after a space, it may be empty.
+            record.get();
+            std::getline(record, node.label);
+        }
+    }
+    return graph;
+}
+
+// Reverse postorder of the nodes reachable from the roots, iterative since
+// linked structures make the graph deep.
+vector<int> reversePostorder(Graph &graph)
+{
+    vector<int> postorder;
+    vector<std::pair<int, size_t>> stack{{0, 0}};
+    vector<bool> visited(graph.nodes.size());
+    visited[0] = true;
+    while (!stack.empty())
+    {
+        auto &[index, next] = stack.back();
+        auto &references = graph.nodes[index].references;
+        if (next < references.size())
+        {
+            auto target = references[next++];
+            graph.nodes[target].predecessors.push_back(index);
+            if (!visited[target])
+            {
+                visited[target] = true;
+                stack.emplace_back(target, 0);
+            }
+        }
+        else
+        {
+            postorder.push_back(index);
+            stack.pop_back();
+        }
+    }
+    std::reverse(postorder.begin(), postorder.end());
+    return postorder;
+}
+
+int intersect(const Graph &graph, int a, int b)
+{
+    while (a != b)
+    {
+        while (graph.nodes[a].order > graph.nodes[b].order)
+            a = graph.nodes[a].idom;
+        while (graph.nodes[b].order > graph.nodes[a].order)
+            b = graph.nodes[b].idom;
+    }
+    return a;
+}
+
+// Cooper, Harvey and Kennedy, "A Simple, Fast Dominance Algorithm".
+void computeDominators(Graph &graph)
+{
+    auto order = reversePostorder(graph);
+    for (size_t i = 0; i < order.size(); i++)
+    {
+        graph.nodes[order[i]].order = static_cast<int>(i);
+    }
+
+    graph.nodes[0].idom = 0;
+    for (bool changed = true; changed;)
+    {
+        changed = false;
+        for (size_t i = 1; i < order.size(); i++)
+        {
+            auto &node = graph.nodes[order[i]];
+            int idom = -1;
+            for (auto predecessor : node.predecessors)
+            {
+                if (graph.nodes[predecessor].idom < 0)
+                    continue;
+                idom = idom < 0 ? predecessor : intersect(graph, predecessor, idom);
+            }
+            if (idom != node.idom)
+            {
+                node.idom = idom;
+                changed = true;
+            }
+        }
+    }
+
+    // Children come after their dominator in reverse postorder.
+    for (auto it = order.rbegin(); it != order.rend(); it++)
+    {
+        auto &node = graph.nodes[*it];
+        node.retained += node.size;
+        if (*it != 0)
+            graph.nodes[node.idom].retained += node.retained;
+    }
+
+    for (auto &node : graph.nodes)
+    {
+        if (node.order < 0)
+        {
+            graph.unreachableObjects++;
+            graph.unreachableBytes += node.size;
+        }
+    }
+}
+
+void printNode(const Node &node)
+{
+    std::cout << std::setw(12) << node.retained << std::setw(10) << node.size << "  "
+              << std::left << std::setw(13) << node.type << std::right << node.address << " " << node.label << std::endl;
+}
+
+void printSummary(const Graph &graph, size_t top)
+{
+    auto &roots = graph.nodes[0];
+    std::cout << "reachable " << roots.retained << " bytes, " << graph.unreachableBytes << " bytes in "
+              << graph.unreachableObjects << " unreachable objects" << std::endl;
+
+    std::cout << std::endl
+              << "reachable by type" << std::endl;
+    std::map<string, std::pair<size_t, size_t>> types;
+    for (auto &node : graph.nodes)
+    {
+        if (node.order <= 0)
+            continue;
+        auto &[count, bytes] = types[node.type];
+        count++;
+        bytes += node.size;
+    }
+    for (auto &[type, totals] : types)
+    {
+        std::cout << "  " << std::left << std::setw(14) << type << std::right << std::setw(10) << totals.first
+                  << " objects" << std::setw(12) << totals.second << " bytes" << std::endl;
+    }
+
+    std::cout << std::endl
+              << std::setw(12) << "retained" << std::setw(10) << "shallow" << "  object" << std::endl;
+    vector<const Node *> nodes;
+    for (auto &node : graph.nodes)
+    {
+        if (node.order > 0)
+            nodes.push_back(&node);
+    }
+    top = std::min(top, nodes.size());
+    std::partial_sort(nodes.begin(), nodes.begin() + top, nodes.end(), [](const Node *a, const Node *b)
+                      { return a->retained > b->retained; });
+    for (size_t i = 0; i < top; i++)
+    {
+        printNode(*nodes[i]);
+    }
+}
+
+void printPath(Graph &graph, const string &address)
+{
+    auto found = graph.indices.find(address);
+    if (found == graph.indices.end())
+        fail("no object at " + address);
+
+    auto index = found->second;
+    if (graph.nodes[index].order < 0)
+    {
+        std::cout << address << " is unreachable" << std::endl;
+        return;
+    }
+    // Innermost first, each line keeps alive the one above it.
+    for (; index != 0; index = graph.nodes[index].idom)
+    {
+        printNode(graph.nodes[index]);
+    }
+    std::cout << std::setw(12) << graph.nodes[0].retained << std::setw(10) << 0 << "  roots" << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+    size_t top = DEFAULT_TOP;
+    string path;
+    char *filename = nullptr;
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        if (arg.starts_with("--top="))
+            top = std::strtoul(arg.c_str() + 6, nullptr, 10);
+        else if (arg.starts_with("--path="))
+            path = arg.substr(7);
+        else if (arg.starts_with("--") || filename)
+            usage();
+        else
+            filename = argv[i];
+    }
+    if (!filename)
+        usage();
+
+    auto graph = readSnapshot(filename);
+    computeDominators(graph);
+    if (path.empty())
+        printSummary(graph, top);
+    else
+        printPath(graph, path);
+    return 0;
+}